@@ -18,8 +18,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // IntermediateProperties
-Rcpp::List IntermediateProperties(Rcpp::NumericMatrix dData, Rcpp::NumericMatrix dCorr, Rcpp::NumericMatrix dNet, Rcpp::CharacterVector tNodeNames, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules);
-RcppExport SEXP _NetRep_IntermediateProperties(SEXP dDataSEXP, SEXP dCorrSEXP, SEXP dNetSEXP, SEXP tNodeNamesSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP) {
+Rcpp::List IntermediateProperties(Rcpp::NumericMatrix dData, Rcpp::NumericMatrix dCorr, Rcpp::NumericMatrix dNet, Rcpp::CharacterVector tNodeNames, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules, Rcpp::IntegerVector nCores);
+RcppExport SEXP _NetRep_IntermediateProperties(SEXP dDataSEXP, SEXP dCorrSEXP, SEXP dNetSEXP, SEXP tNodeNamesSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP, SEXP nCoresSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -29,13 +29,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type tNodeNames(tNodeNamesSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type moduleAssignments(moduleAssignmentsSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type modules(modulesSEXP);
-    rcpp_result_gen = Rcpp::wrap(IntermediateProperties(dData, dCorr, dNet, tNodeNames, moduleAssignments, modules));
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type nCores(nCoresSEXP);
+    rcpp_result_gen = Rcpp::wrap(IntermediateProperties(dData, dCorr, dNet, tNodeNames, moduleAssignments, modules, nCores));
     return rcpp_result_gen;
 END_RCPP
 }
 // IntermediatePropertiesNoData
-Rcpp::List IntermediatePropertiesNoData(Rcpp::NumericMatrix dCorr, Rcpp::NumericMatrix dNet, Rcpp::CharacterVector tNodeNames, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules);
-RcppExport SEXP _NetRep_IntermediatePropertiesNoData(SEXP dCorrSEXP, SEXP dNetSEXP, SEXP tNodeNamesSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP) {
+Rcpp::List IntermediatePropertiesNoData(Rcpp::NumericMatrix dCorr, Rcpp::NumericMatrix dNet, Rcpp::CharacterVector tNodeNames, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules, Rcpp::IntegerVector nCores);
+RcppExport SEXP _NetRep_IntermediatePropertiesNoData(SEXP dCorrSEXP, SEXP dNetSEXP, SEXP tNodeNamesSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP, SEXP nCoresSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -44,54 +45,81 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type tNodeNames(tNodeNamesSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type moduleAssignments(moduleAssignmentsSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type modules(modulesSEXP);
-    rcpp_result_gen = Rcpp::wrap(IntermediatePropertiesNoData(dCorr, dNet, tNodeNames, moduleAssignments, modules));
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type nCores(nCoresSEXP);
+    rcpp_result_gen = Rcpp::wrap(IntermediatePropertiesNoData(dCorr, dNet, tNodeNames, moduleAssignments, modules, nCores));
     return rcpp_result_gen;
 END_RCPP
 }
-// PermutationProcedure
-Rcpp::List PermutationProcedure(Rcpp::List discProps, Rcpp::NumericMatrix tData, Rcpp::NumericMatrix tCorr, Rcpp::NumericMatrix tNet, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules, Rcpp::IntegerVector nPermutations, Rcpp::IntegerVector nCores, Rcpp::CharacterVector nullHypothesis, Rcpp::LogicalVector verbose, Rcpp::Function vCat);
-RcppExport SEXP _NetRep_PermutationProcedure(SEXP discPropsSEXP, SEXP tDataSEXP, SEXP tCorrSEXP, SEXP tNetSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP, SEXP nPermutationsSEXP, SEXP nCoresSEXP, SEXP nullHypothesisSEXP, SEXP verboseSEXP, SEXP vCatSEXP) {
+// SetSplitMinCost
+double SetSplitMinCost(double cost);
+RcppExport SEXP _NetRep_SetSplitMinCost(SEXP costSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< Rcpp::List >::type discProps(discPropsSEXP);
-    Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type tData(tDataSEXP);
-    Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type tCorr(tCorrSEXP);
-    Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type tNet(tNetSEXP);
-    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type moduleAssignments(moduleAssignmentsSEXP);
-    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type modules(modulesSEXP);
-    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type nPermutations(nPermutationsSEXP);
-    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type nCores(nCoresSEXP);
-    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type nullHypothesis(nullHypothesisSEXP);
-    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type verbose(verboseSEXP);
-    Rcpp::traits::input_parameter< Rcpp::Function >::type vCat(vCatSEXP);
-    rcpp_result_gen = Rcpp::wrap(PermutationProcedure(discProps, tData, tCorr, tNet, moduleAssignments, modules, nPermutations, nCores, nullHypothesis, verbose, vCat));
+    Rcpp::traits::input_parameter< double >::type cost(costSEXP);
+    rcpp_result_gen = Rcpp::wrap(SetSplitMinCost(cost));
+    return rcpp_result_gen;
+END_RCPP
+}
+// NullsFileInfo
+Rcpp::List NullsFileInfo(Rcpp::CharacterVector file);
+RcppExport SEXP _NetRep_NullsFileInfo(SEXP fileSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type file(fileSEXP);
+    rcpp_result_gen = Rcpp::wrap(NullsFileInfo(file));
     return rcpp_result_gen;
 END_RCPP
 }
-// PermutationProcedureNoData
-Rcpp::List PermutationProcedureNoData(Rcpp::List discProps, Rcpp::NumericMatrix tCorr, Rcpp::NumericMatrix tNet, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules, Rcpp::IntegerVector nPermutations, Rcpp::IntegerVector nCores, Rcpp::CharacterVector nullHypothesis, Rcpp::LogicalVector verbose, Rcpp::Function vCat);
-RcppExport SEXP _NetRep_PermutationProcedureNoData(SEXP discPropsSEXP, SEXP tCorrSEXP, SEXP tNetSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP, SEXP nPermutationsSEXP, SEXP nCoresSEXP, SEXP nullHypothesisSEXP, SEXP verboseSEXP, SEXP vCatSEXP) {
+// ReadNullsFile
+Rcpp::NumericVector ReadNullsFile(Rcpp::CharacterVector file, Rcpp::IntegerVector first, Rcpp::IntegerVector count);
+RcppExport SEXP _NetRep_ReadNullsFile(SEXP fileSEXP, SEXP firstSEXP, SEXP countSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type file(fileSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type first(firstSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type count(countSEXP);
+    rcpp_result_gen = Rcpp::wrap(ReadNullsFile(file, first, count));
+    return rcpp_result_gen;
+END_RCPP
+}
+// PermutationProcedure
+Rcpp::List PermutationProcedure(Rcpp::List discProps, Rcpp::NumericMatrix tData, Rcpp::NumericMatrix tCorr, Rcpp::NumericMatrix tNet, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules, Rcpp::CharacterVector statistics, Rcpp::LogicalVector shareNulls, Rcpp::IntegerVector nPermutations, Rcpp::IntegerVector nCores, Rcpp::CharacterVector nullHypothesis, Rcpp::IntegerVector seed, Rcpp::LogicalVector keepNulls, Rcpp::LogicalVector keepTails, Rcpp::CharacterVector nullsFile, Rcpp::LogicalVector resume, Rcpp::NumericVector sequential, Rcpp::IntegerVector alternative, Rcpp::NumericVector timeLimit, Rcpp::IntegerVector minPermutations, Rcpp::LogicalVector verbose, Rcpp::Function vCat);
+RcppExport SEXP _NetRep_PermutationProcedure(SEXP discPropsSEXP, SEXP tDataSEXP, SEXP tCorrSEXP, SEXP tNetSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP, SEXP statisticsSEXP, SEXP shareNullsSEXP, SEXP nPermutationsSEXP, SEXP nCoresSEXP, SEXP nullHypothesisSEXP, SEXP seedSEXP, SEXP keepNullsSEXP, SEXP keepTailsSEXP, SEXP nullsFileSEXP, SEXP resumeSEXP, SEXP sequentialSEXP, SEXP alternativeSEXP, SEXP timeLimitSEXP, SEXP minPermutationsSEXP, SEXP verboseSEXP, SEXP vCatSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::List >::type discProps(discPropsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type tData(tDataSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type tCorr(tCorrSEXP);
     Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type tNet(tNetSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type moduleAssignments(moduleAssignmentsSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type modules(modulesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type statistics(statisticsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type shareNulls(shareNullsSEXP);
     Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type nPermutations(nPermutationsSEXP);
     Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type nCores(nCoresSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type nullHypothesis(nullHypothesisSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type keepNulls(keepNullsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type keepTails(keepTailsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type nullsFile(nullsFileSEXP);
+    Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type resume(resumeSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type sequential(sequentialSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type alternative(alternativeSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type timeLimit(timeLimitSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type minPermutations(minPermutationsSEXP);
     Rcpp::traits::input_parameter< Rcpp::LogicalVector >::type verbose(verboseSEXP);
     Rcpp::traits::input_parameter< Rcpp::Function >::type vCat(vCatSEXP);
-    rcpp_result_gen = Rcpp::wrap(PermutationProcedureNoData(discProps, tCorr, tNet, moduleAssignments, modules, nPermutations, nCores, nullHypothesis, verbose, vCat));
+    rcpp_result_gen = Rcpp::wrap(PermutationProcedure(discProps, tData, tCorr, tNet, moduleAssignments, modules, statistics, shareNulls, nPermutations, nCores, nullHypothesis, seed, keepNulls, keepTails, nullsFile, resume, sequential, alternative, timeLimit, minPermutations, verbose, vCat));
     return rcpp_result_gen;
 END_RCPP
 }
 // NetProps
-Rcpp::List NetProps(Rcpp::NumericMatrix data, Rcpp::NumericMatrix net, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules);
-RcppExport SEXP _NetRep_NetProps(SEXP dataSEXP, SEXP netSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP) {
+Rcpp::List NetProps(Rcpp::NumericMatrix data, Rcpp::NumericMatrix net, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules, Rcpp::IntegerVector nCores);
+RcppExport SEXP _NetRep_NetProps(SEXP dataSEXP, SEXP netSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP, SEXP nCoresSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -99,20 +127,22 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type net(netSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type moduleAssignments(moduleAssignmentsSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type modules(modulesSEXP);
-    rcpp_result_gen = Rcpp::wrap(NetProps(data, net, moduleAssignments, modules));
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type nCores(nCoresSEXP);
+    rcpp_result_gen = Rcpp::wrap(NetProps(data, net, moduleAssignments, modules, nCores));
     return rcpp_result_gen;
 END_RCPP
 }
 // NetPropsNoData
-Rcpp::List NetPropsNoData(Rcpp::NumericMatrix net, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules);
-RcppExport SEXP _NetRep_NetPropsNoData(SEXP netSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP) {
+Rcpp::List NetPropsNoData(Rcpp::NumericMatrix net, Rcpp::CharacterVector moduleAssignments, Rcpp::CharacterVector modules, Rcpp::IntegerVector nCores);
+RcppExport SEXP _NetRep_NetPropsNoData(SEXP netSEXP, SEXP moduleAssignmentsSEXP, SEXP modulesSEXP, SEXP nCoresSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type net(netSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type moduleAssignments(moduleAssignmentsSEXP);
     Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type modules(modulesSEXP);
-    rcpp_result_gen = Rcpp::wrap(NetPropsNoData(net, moduleAssignments, modules));
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type nCores(nCoresSEXP);
+    rcpp_result_gen = Rcpp::wrap(NetPropsNoData(net, moduleAssignments, modules, nCores));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -130,12 +160,14 @@ END_RCPP
 
 static const R_CallMethodDef CallEntries[] = {
     {"_NetRep_CheckFinite", (DL_FUNC) &_NetRep_CheckFinite, 1},
-    {"_NetRep_IntermediateProperties", (DL_FUNC) &_NetRep_IntermediateProperties, 6},
-    {"_NetRep_IntermediatePropertiesNoData", (DL_FUNC) &_NetRep_IntermediatePropertiesNoData, 5},
-    {"_NetRep_PermutationProcedure", (DL_FUNC) &_NetRep_PermutationProcedure, 11},
-    {"_NetRep_PermutationProcedureNoData", (DL_FUNC) &_NetRep_PermutationProcedureNoData, 10},
-    {"_NetRep_NetProps", (DL_FUNC) &_NetRep_NetProps, 4},
-    {"_NetRep_NetPropsNoData", (DL_FUNC) &_NetRep_NetPropsNoData, 3},
+    {"_NetRep_IntermediateProperties", (DL_FUNC) &_NetRep_IntermediateProperties, 7},
+    {"_NetRep_IntermediatePropertiesNoData", (DL_FUNC) &_NetRep_IntermediatePropertiesNoData, 6},
+    {"_NetRep_SetSplitMinCost", (DL_FUNC) &_NetRep_SetSplitMinCost, 1},
+    {"_NetRep_NullsFileInfo", (DL_FUNC) &_NetRep_NullsFileInfo, 1},
+    {"_NetRep_ReadNullsFile", (DL_FUNC) &_NetRep_ReadNullsFile, 3},
+    {"_NetRep_PermutationProcedure", (DL_FUNC) &_NetRep_PermutationProcedure, 22},
+    {"_NetRep_NetProps", (DL_FUNC) &_NetRep_NetProps, 5},
+    {"_NetRep_NetPropsNoData", (DL_FUNC) &_NetRep_NetPropsNoData, 4},
     {"_NetRep_Scale", (DL_FUNC) &_NetRep_Scale, 1},
     {NULL, NULL, 0}
 };
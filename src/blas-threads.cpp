@@ -0,0 +1,118 @@
+#include "blas-threads.h"
+
+#if !defined (_WIN32) && !defined (_WIN64)
+  #include <dlfcn.h>
+#endif
+
+// Thread controls exported by the BLAS libraries and OpenMP runtime
+struct BlasApi {
+  BlasApi ();
+  std::string library;
+  void (*setThreads) (int); // process wide thread count
+  int (*getThreads) ();
+  int (*setLocalThreads) (int); // thread count for the calling thread (MKL)
+  void (*bliSetThreads) (long); // BLIS takes a 'dim_t'
+  long (*bliGetThreads) ();
+  void (*ompSetThreads) (int); // OpenMP thread count for the calling thread
+};
+
+// Find a function in the libraries already loaded into the R session
+static void * Lookup (const char * name) {
+  #if !defined (_WIN32) && !defined (_WIN64)
+    return dlsym(RTLD_DEFAULT, name);
+  #else
+    // R on Windows ships a single threaded reference BLAS
+    return NULL;
+  #endif
+}
+
+BlasApi::BlasApi () : 
+  setThreads(NULL), getThreads(NULL), setLocalThreads(NULL), 
+  bliSetThreads(NULL), bliGetThreads(NULL), ompSetThreads(NULL) 
+{
+  ompSetThreads = (void (*)(int))Lookup("omp_set_num_threads");
+  if (Lookup("openblas_set_num_threads") != NULL) {
+    library = "OpenBLAS";
+    setThreads = (void (*)(int))Lookup("openblas_set_num_threads");
+    getThreads = (int (*)())Lookup("openblas_get_num_threads");
+  } else if (Lookup("MKL_Set_Num_Threads") != NULL) {
+    library = "MKL";
+    setThreads = (void (*)(int))Lookup("MKL_Set_Num_Threads");
+    getThreads = (int (*)())Lookup("MKL_Get_Max_Threads");
+    setLocalThreads = (int (*)(int))Lookup("MKL_Set_Num_Threads_Local");
+  } else if (Lookup("bli_thread_set_num_threads") != NULL) {
+    library = "BLIS";
+    bliSetThreads = (void (*)(long))Lookup("bli_thread_set_num_threads");
+    bliGetThreads = (long (*)())Lookup("bli_thread_get_num_threads");
+  }
+}
+
+// The thread controls are looked up once, the first time they are needed.
+static const BlasApi& Api () {
+  static const BlasApi api;
+  return api;
+}
+
+/* Name of the multithreaded BLAS library R is using
+ * 
+ * @return "OpenBLAS", "MKL", or "BLIS", or an empty string if the BLAS 
+ *   library's threads cannot be controlled.
+ */
+std::string BlasLibrary () {
+  return Api().library;
+}
+
+/* Number of threads the BLAS library will use
+ * 
+ * @return the number of threads, or 1 if unknown.
+ */
+int GetBlasThreads () {
+  const BlasApi& api = Api();
+  int nThreads = 1;
+  if (api.getThreads != NULL) {
+    nThreads = api.getThreads();
+  } else if (api.bliGetThreads != NULL) {
+    nThreads = (int)api.bliGetThreads();
+  }
+  return nThreads < 1 ? 1 : nThreads;
+}
+
+/* Set the number of threads the BLAS library will use in all threads
+ * 
+ * @param nThreads number of threads.
+ */
+void SetBlasThreads (int nThreads) {
+  const BlasApi& api = Api();
+  if (api.setThreads != NULL) {
+    api.setThreads(nThreads);
+  } else if (api.bliSetThreads != NULL) {
+    api.bliSetThreads(nThreads);
+  }
+}
+
+/* Restrict BLAS to a single thread when called from this thread
+ * 
+ * Called by each thread in the 'ThreadPool' when it starts. Covers the 
+ * libraries with per-thread controls (MKL) and those threaded through 
+ * OpenMP, whose thread count is per-thread. 'SetBlasThreads' handles the 
+ * rest.
+ */
+void PinBlasToThread () {
+  const BlasApi& api = Api();
+  if (api.setLocalThreads != NULL) {
+    api.setLocalThreads(1);
+  }
+  if (api.ompSetThreads != NULL) {
+    api.ompSetThreads(1);
+  }
+}
+
+/* @param nThreads number of BLAS threads to use until the end of the scope.
+ */
+BlasThreadScope::BlasThreadScope (int nThreads) : previous(GetBlasThreads()) {
+  SetBlasThreads(nThreads);
+}
+
+BlasThreadScope::~BlasThreadScope () {
+  SetBlasThreads(previous);
+}
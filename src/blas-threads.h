@@ -0,0 +1,29 @@
+#ifndef __BLASTHREADS__
+#define __BLASTHREADS__
+
+#include <string>
+
+/* Control over the number of threads used by the BLAS/LAPACK library
+ * 
+ * R may be linked against a multithreaded BLAS (OpenBLAS, MKL, or BLIS), 
+ * whose thread teams would oversubscribe the machine if started from each 
+ * of our own threads. The library's thread controls are looked up at run 
+ * time, since R can be linked against any of them, or none. Without them, 
+ * these functions do nothing.
+ */
+std::string BlasLibrary ();
+int GetBlasThreads ();
+void SetBlasThreads (int);
+void PinBlasToThread ();
+
+/* Set the number of BLAS threads until the end of the scope
+ */
+class BlasThreadScope {
+public:
+  BlasThreadScope (int);
+  ~BlasThreadScope ();
+private:
+  int previous;
+};
+
+#endif // __BLASTHREADS__
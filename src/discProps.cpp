@@ -1,5 +1,7 @@
 #include "utils.h"
 #include "netStats.h"
+#include "thread-utils.h"
+#include "largeModules.h"
 
 ///' Calculate the intermediate network properties in the discovery dataset
 ///' 
@@ -34,6 +36,8 @@
 ///'   each node belongs to in the discovery dataset. 
 ///' @param modules a character vector of modules for which to calculate the 
 ///'   module preservation statistics.
+///' @param nCores number of threads to calculate the properties of different
+///'   modules on in parallel.
 ///' 
 ///' @return a list containing three lists: a list of weighted degree vectors,
 ///'   a list of correlation coefficient vectors, and a list of node 
@@ -44,7 +48,7 @@
 Rcpp::List IntermediateProperties (
     Rcpp::NumericMatrix dData, Rcpp::NumericMatrix dCorr, Rcpp::NumericMatrix dNet,
     Rcpp::CharacterVector tNodeNames, Rcpp::CharacterVector moduleAssignments, 
-    Rcpp::CharacterVector modules
+    Rcpp::CharacterVector modules, Rcpp::IntegerVector nCores
 ) {
   // First, scale the matrix data
   unsigned int nSamples = dData.nrow();
@@ -80,45 +84,57 @@ Rcpp::List IntermediateProperties (
   
   R_CheckUserInterrupt(); 
   
-  Rcpp::List degree;
-  Rcpp::List corr;
-  Rcpp::List contribution;
-  
-  // Calculate the network properties in the discovery dataset.
-  std::string mod;
-  unsigned int mNodes;
-  arma::uvec dIdx, dRank;
-  arma::vec dSP, dWD, dCV, dNC; 
-  for (auto mi = modsPresent.begin(); mi != modsPresent.end(); ++mi) {
-    // Get the node indices in the discovery dataset for this module
-    mod = *mi;
-    dIdx = GetNodeIdx(mod, modNodePresentMap, dIdxMap);
-    mNodes = dIdx.n_elem;
-    R_CheckUserInterrupt(); 
+  // Look up each module's nodes before going parallel: the threads cannot 
+  // use R's API.
+  std::vector<arma::uvec> dIdx (modsPresent.size());
+  for (unsigned int mi = 0; mi < modsPresent.size(); ++mi) {
+    dIdx[mi] = GetNodeIdx(modsPresent[mi], modNodePresentMap, dIdxMap);
+  }
+  double * dDataAddr = dData.begin();
+  double * dCorrAddr = dCorr.begin();
+  double * dNetAddr = dNet.begin();
+  
+  // Calculate the network properties of module 'mi' in the discovery dataset,
+  // splitting the work across 'nSplit' threads. Each module's results go in 
+  // their own slot.
+  std::vector<arma::vec> dWD (modsPresent.size());
+  std::vector<arma::vec> dCV (modsPresent.size());
+  std::vector<arma::vec> dNC (modsPresent.size());
+  auto calculate = [&](unsigned int mi, unsigned int nSplit) {
+    unsigned int mNodes = dIdx[mi].n_elem;
     
     // Calculate the network properties and insert into their storage containers
-    dCV = CorrVector(dCorr.begin(), nNodes, dIdx.memptr(), mNodes);
-    R_CheckUserInterrupt(); 
+    dCV[mi] = SplitCorrVector(nSplit, dCorrAddr, nNodes, dIdx[mi].memptr(), mNodes);
     
     // Sort node indices for sequential memory access
-    dRank = SortNodes(dIdx.memptr(), mNodes); 
+    arma::uvec dRank = SortNodes(dIdx[mi].memptr(), mNodes); 
     
-    dWD = WeightedDegree(dNet.begin(), nNodes, dIdx.memptr(), mNodes);
-    dWD = dWD(dRank); // reorder
-    R_CheckUserInterrupt(); 
+    dWD[mi] = SplitWeightedDegree(nSplit, dNetAddr, nNodes, dIdx[mi].memptr(), 
+                                  mNodes);
+    dWD[mi] = dWD[mi](dRank); // reorder
     
-    dSP = SummaryProfile(dData.begin(), nSamples, nNodes, dIdx.memptr(), mNodes);
-    R_CheckUserInterrupt(); 
+    arma::vec dSP = SplitSummaryProfile(nSplit, dDataAddr, nSamples, 
+                                        dIdx[mi].memptr(), mNodes);
     
-    dNC = NodeContribution(dData.begin(), nSamples, nNodes, 
-                           dIdx.memptr(), mNodes, dSP.memptr());
-    dNC = dNC(dRank); // reorder results
-    R_CheckUserInterrupt(); 
-    
-    // Cast to R-vectors and add to results lists
-    corr.push_back(Rcpp::NumericVector(dCV.begin(), dCV.end()));
-    degree.push_back(Rcpp::NumericVector(dWD.begin(), dWD.end()));
-    contribution.push_back(Rcpp::NumericVector(dNC.begin(), dNC.end()));
+    dNC[mi] = SplitNodeContribution(nSplit, dDataAddr, nSamples, 
+                                    dIdx[mi].memptr(), mNodes, dSP.memptr());
+    dNC[mi] = dNC[mi](dRank); // reorder results
+  };
+  
+  std::vector<double> cost (modsPresent.size());
+  for (unsigned int mi = 0; mi < modsPresent.size(); ++mi) {
+    cost[mi] = ModuleCost(dIdx[mi].n_elem, nSamples);
+  }
+  ForEachModule(cost, nCores[0], calculate);
+  
+  // Cast to R-vectors and add to results lists
+  Rcpp::List degree (modsPresent.size());
+  Rcpp::List corr (modsPresent.size());
+  Rcpp::List contribution (modsPresent.size());
+  for (unsigned int mi = 0; mi < modsPresent.size(); ++mi) {
+    corr[mi] = Rcpp::NumericVector(dCV[mi].begin(), dCV[mi].end());
+    degree[mi] = Rcpp::NumericVector(dWD[mi].begin(), dWD[mi].end());
+    contribution[mi] = Rcpp::NumericVector(dNC[mi].begin(), dNC[mi].end());
   }
   degree.names() = modsPresent;
   corr.names() = modsPresent;
@@ -161,6 +177,8 @@ Rcpp::List IntermediateProperties (
 ///'   each node belongs to in the discovery dataset. 
 ///' @param modules a character vector of modules for which to calculate the 
 ///'   module preservation statistics.
+///' @param nCores number of threads to calculate the properties of different
+///'   modules on in parallel.
 ///' 
 ///' @return a list containing two lists: a list of weighted degree vectors,
 ///'   and a list of correlation coefficient vectors. There is one vector for 
@@ -171,7 +189,7 @@ Rcpp::List IntermediateProperties (
 Rcpp::List IntermediatePropertiesNoData (
     Rcpp::NumericMatrix dCorr, Rcpp::NumericMatrix dNet,
     Rcpp::CharacterVector tNodeNames, Rcpp::CharacterVector moduleAssignments, 
-    Rcpp::CharacterVector modules
+    Rcpp::CharacterVector modules, Rcpp::IntegerVector nCores
 ) {
   unsigned int nNodes = dNet.ncol();
   
@@ -203,36 +221,46 @@ Rcpp::List IntermediatePropertiesNoData (
   
   R_CheckUserInterrupt(); 
   
-  Rcpp::List degree;
-  Rcpp::List corr;
-
-  // Calculate the network properties in the discovery dataset.
-  std::string mod;
-  unsigned int mNodes;
-  
-  arma::uvec dIdx, dRank;
-  arma::vec dWD, dCV; 
-  for (auto mi = modsPresent.begin(); mi != modsPresent.end(); ++mi) {
-    // Get the node indices in the discovery dataset for this module
-    mod = *mi;
-    dIdx = GetNodeIdx(mod, modNodePresentMap, dIdxMap);
-    mNodes = dIdx.n_elem;
-    R_CheckUserInterrupt(); 
+  // Look up each module's nodes before going parallel: the threads cannot 
+  // use R's API.
+  std::vector<arma::uvec> dIdx (modsPresent.size());
+  for (unsigned int mi = 0; mi < modsPresent.size(); ++mi) {
+    dIdx[mi] = GetNodeIdx(modsPresent[mi], modNodePresentMap, dIdxMap);
+  }
+  double * dCorrAddr = dCorr.begin();
+  double * dNetAddr = dNet.begin();
+  
+  // Calculate the network properties of module 'mi' in the discovery dataset,
+  // splitting the work across 'nSplit' threads. Each module's results go in 
+  // their own slot.
+  std::vector<arma::vec> dWD (modsPresent.size());
+  std::vector<arma::vec> dCV (modsPresent.size());
+  auto calculate = [&](unsigned int mi, unsigned int nSplit) {
+    unsigned int mNodes = dIdx[mi].n_elem;
     
     // Calculate the network properties and insert into their storage containers
-    dCV = CorrVector(dCorr.begin(), nNodes, dIdx.memptr(), mNodes);
-    R_CheckUserInterrupt(); 
+    dCV[mi] = SplitCorrVector(nSplit, dCorrAddr, nNodes, dIdx[mi].memptr(), mNodes);
     
     // Sort node indices for sequential memory access
-    dRank = SortNodes(dIdx.memptr(), mNodes); 
-    
-    dWD = WeightedDegree(dNet.begin(), nNodes, dIdx.memptr(), mNodes);
-    dWD = dWD(dRank); // reorder
-    R_CheckUserInterrupt(); 
+    arma::uvec dRank = SortNodes(dIdx[mi].memptr(), mNodes); 
     
-    // Cast to R-vectors and add to results lists
-    corr.push_back(Rcpp::NumericVector(dCV.begin(), dCV.end()));
-    degree.push_back(Rcpp::NumericVector(dWD.begin(), dWD.end()));
+    dWD[mi] = SplitWeightedDegree(nSplit, dNetAddr, nNodes, dIdx[mi].memptr(), 
+                                  mNodes);
+    dWD[mi] = dWD[mi](dRank); // reorder
+  };
+  
+  std::vector<double> cost (modsPresent.size());
+  for (unsigned int mi = 0; mi < modsPresent.size(); ++mi) {
+    cost[mi] = ModuleCost(dIdx[mi].n_elem, 0);
+  }
+  ForEachModule(cost, nCores[0], calculate);
+  
+  // Cast to R-vectors and add to results lists
+  Rcpp::List degree (modsPresent.size());
+  Rcpp::List corr (modsPresent.size());
+  for (unsigned int mi = 0; mi < modsPresent.size(); ++mi) {
+    corr[mi] = Rcpp::NumericVector(dCV[mi].begin(), dCV[mi].end());
+    degree[mi] = Rcpp::NumericVector(dWD[mi].begin(), dWD[mi].end());
   }
   degree.names() = modsPresent;
   corr.names() = modsPresent;
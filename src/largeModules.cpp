@@ -0,0 +1,256 @@
+/* Network properties of very large modules, split across threads
+ * 
+ * The observed test statistics and discovery properties are calculated in 
+ * parallel across modules (see 'ParallelFor'), which leaves all but one 
+ * thread idle when a single module dominates the total work. Such modules 
+ * are instead calculated one at a time after the others, with the work 
+ * within each module split into tiles of nodes that are shared between all 
+ * threads. Each function here falls back to its single threaded counterpart
+ * in netStats.cpp when given one thread.
+ */
+
+#include "largeModules.h"
+#include "netStats.h"
+#include "thread-utils.h"
+#include "blas-threads.h"
+
+/* Estimate the work needed to calculate a module's network properties
+ * 
+ * Counts the elements read when gathering the module's correlation and 
+ * network sub-matrices, and the floating point operations in the cross 
+ * product of its data that dominates the summary profile.
+ * 
+ * @param mNodes number of nodes in the module.
+ * @param nSamples number of samples in the data matrix, or 0 if there is no
+ *   data.
+ * 
+ * @return the approximate number of operations.
+ */
+double ModuleCost (unsigned int mNodes, unsigned int nSamples) {
+  double mm = mNodes;
+  double nn = nSamples;
+  return 2 * mm * mm + nn * mm * std::min(nn, mm);
+}
+
+// Smallest cost of a module split across threads, see 'SetSplitMinCost'
+static double splitMinCost = SPLIT_MIN_COST;
+
+///' Set the smallest module that is split across threads
+///'
+///' Modules are only split across threads if their cost is at least this
+///' large (see 'ModuleCost'). Lowering it lets the tests reach the split
+///' calculations with small datasets.
+///'
+///' @param cost the new minimum cost, 'SPLIT_MIN_COST' by default.
+///'
+///' @return the previous minimum cost.
+///'
+///' @keywords internal
+// [[Rcpp::export]]
+double SetSplitMinCost (double cost) {
+  double old = splitMinCost;
+  splitMinCost = cost;
+  return old;
+}
+
+/* Decide which modules to split across threads
+ * 
+ * A module is split if it would take longer on its own thread than the 
+ * whole workload takes when evenly spread across all threads, i.e. if it 
+ * would hold up the other threads, and if it is large enough that splitting
+ * is worth the overhead (see 'SetSplitMinCost').
+ * 
+ * @param cost the cost of each module, see 'ModuleCost'.
+ * @param nThreads number of threads available.
+ * @param whole set to the indices of the modules to calculate in parallel 
+ *   with each other.
+ * @param split set to the indices of the modules to split across threads.
+ */
+void SplitModules (
+  const std::vector<double>& cost, unsigned int nThreads, 
+  std::vector<unsigned int>& whole, std::vector<unsigned int>& split
+) {
+  double total = 0;
+  for (unsigned int mi = 0; mi < cost.size(); ++mi) {
+    total += cost[mi];
+  }
+  whole.clear();
+  split.clear();
+  for (unsigned int mi = 0; mi < cost.size(); ++mi) {
+    if (nThreads > 1 && cost[mi] >= splitMinCost && 
+        cost[mi] > total / nThreads) {
+      split.push_back(mi);
+    } else {
+      whole.push_back(mi);
+    }
+  }
+}
+
+/* Calculate each module's network properties, splitting the largest ones
+ * 
+ * Modules are calculated one per thread at a time, except for any large
+ * enough to hold up the other threads (see 'SplitModules'), which are then
+ * calculated one at a time with their work split across all threads.
+ * 
+ * @param cost the cost of each module, see 'ModuleCost'.
+ * @param nThreads number of threads available.
+ * @param calculate function to call with the index of each module and the
+ *   number of threads to split its work across.
+ */
+void ForEachModule (
+  const std::vector<double>& cost, unsigned int nThreads, 
+  const std::function<void(unsigned int, unsigned int)>& calculate
+) {
+  std::vector<unsigned int> whole, split;
+  SplitModules(cost, nThreads, whole, split);
+  ParallelFor(nThreads, whole.size(), [&](unsigned int ii) {
+    calculate(whole[ii], 1);
+  });
+  for (unsigned int ii = 0; ii < split.size(); ++ii) {
+    calculate(split[ii], nThreads);
+  }
+}
+
+/* Divide a module's nodes into tiles and process them in parallel
+ * 
+ * @param nThreads number of threads to use.
+ * @param mNodes number of nodes in the module.
+ * @param tile function to call with the first node, and one past the last 
+ *   node, of each tile.
+ */
+static void ForEachTile (
+  unsigned int nThreads, unsigned int mNodes, 
+  const std::function<void(unsigned int, unsigned int)>& tile
+) {
+  unsigned int nTiles = std::min(nThreads * TILES_PER_THREAD, mNodes);
+  ParallelFor(nThreads, nTiles, [&](unsigned int ti) {
+    tile((std::size_t)ti * mNodes / nTiles, 
+         (std::size_t)(ti + 1) * mNodes / nTiles);
+  });
+}
+
+/* Get a vector of correlation coefficients for a module, see 'CorrVector'
+ * 
+ * @param nThreads number of threads to split the work across.
+ * @param corrAddr address in memory of the matrix of correlation coefficients.
+ * @param nNodes number of nodes in the correlation matrix. 
+ * @param idxAddr memory address of the indices of the module's nodes.
+ * @param mNodes number of nodes in the module.
+ *
+ * @return a vector of correlation coefficients
+ */
+arma::vec SplitCorrVector (
+  unsigned int nThreads, double * corrAddr, unsigned int nNodes, 
+  unsigned int * idxAddr, unsigned int mNodes
+) {
+  if (nThreads == 1) {
+    return CorrVector(corrAddr, nNodes, idxAddr, mNodes);
+  }
+  arma::vec corrVec (((std::size_t)mNodes*mNodes - mNodes)/2);
+  ForEachTile(nThreads, mNodes, [&](unsigned int first, unsigned int last) {
+    CorrVectorTile(corrAddr, nNodes, idxAddr, mNodes, first, last, 
+                   corrVec.memptr());
+  });
+  return corrVec;
+}
+
+/* Calculate the weighted degree of a module, see 'WeightedDegree'
+ * 
+ * @param nThreads number of threads to split the work across.
+ * @param netAddr address of the network's adjacency matrix in memory.
+ * @param nNodes number of nodes in the network.
+ * @param idxAddr memory address of ascending-order sorted indices of the 
+ *  module's nodes.
+ * @param mNodes number of nodes in the module.
+ *
+ * @return a (column) vector of the weighted degree.
+ */
+arma::vec SplitWeightedDegree (
+  unsigned int nThreads, double * netAddr, unsigned int nNodes, 
+  unsigned int * idxAddr, unsigned int mNodes
+) {
+  if (nThreads == 1) {
+    return WeightedDegree(netAddr, nNodes, idxAddr, mNodes);
+  }
+  arma::vec wDegree (mNodes);
+  ForEachTile(nThreads, mNodes, [&](unsigned int first, unsigned int last) {
+    WeightedDegreeTile(netAddr, nNodes, idxAddr, mNodes, first, last, 
+                       wDegree.memptr());
+  });
+  return wDegree;
+}
+
+/* Calculate the summary profile of a module, see 'SummaryProfile'
+ * 
+ * The module's data is gathered a tile of nodes per thread, then decomposed
+ * by the same LAPACK SVD as 'SummaryProfile' with 'nThreads' BLAS threads,
+ * so that the summary profile does not depend on whether the module was 
+ * split.
+ * 
+ * @param nThreads number of threads to split the work across.
+ * @param dataAddr address of the data matrix in memory.
+ * @param nSamples number of samples in the data matrix.
+ * @param idxAddr memory address of the ascending-order sorted indices of the 
+ *  module's nodes.
+ * @param mNodes number of nodes in the module.
+ * 
+ * @return a vector of observations across samples
+ */
+arma::vec SplitSummaryProfile (
+  unsigned int nThreads, double * dataAddr, unsigned int nSamples, 
+  unsigned int * idxAddr, unsigned int mNodes
+) {
+  if (nThreads == 1) {
+    return SummaryProfile(dataAddr, nSamples, idxAddr, mNodes);
+  }
+  arma::mat modData (nSamples, mNodes);
+  ForEachTile(nThreads, mNodes, [&](unsigned int first, unsigned int last) {
+    for (unsigned int jj = first; jj < last; ++jj) {
+      std::copy(dataAddr + (std::size_t)idxAddr[jj] * nSamples, 
+                dataAddr + ((std::size_t)idxAddr[jj] + 1) * nSamples,
+                modData.colptr(jj));
+    }
+  });
+  
+  arma::mat U, V;
+  arma::vec S;
+  arma::vec summary (nSamples);
+  BlasThreadScope blas (nThreads);
+  if (arma::svd_econ(U, S, V, modData, "left", "dc")) {
+    summary = U.col(0);
+  } else {
+    summary.fill(arma::datum::nan);
+    return summary;
+  }
+  OrientSummaryProfile(modData, summary.memptr());
+  return summary;
+}
+
+/* Calculate the contribution of each node to the summary profile, see 
+ * 'NodeContribution'
+ * 
+ * @param nThreads number of threads to split the work across.
+ * @param dataAddr address in memory of the data matrix.
+ * @param nSamples number of samples in the data matrix and summar profile.
+ * @param idxAddr memory address of the  ascending-order sorted indices of the 
+ *  module's nodes.
+ * @param mNodes number of nodes in the module.
+ * @param summaryAddr memory address of the summary profile vector, see 
+ *  'SummaryProfile'.
+ *
+ * @return a vector of correlations between each node and the summary profile
+ */
+arma::vec SplitNodeContribution (
+  unsigned int nThreads, double * dataAddr, unsigned int nSamples, 
+  unsigned int * idxAddr, unsigned int mNodes, double * summaryAddr
+) {
+  if (nThreads == 1) {
+    return NodeContribution(dataAddr, nSamples, idxAddr, mNodes, summaryAddr);
+  }
+  arma::vec contribution (mNodes);
+  ForEachTile(nThreads, mNodes, [&](unsigned int first, unsigned int last) {
+    NodeContribution(dataAddr, nSamples, idxAddr + first, last - first, 
+                     summaryAddr, contribution.memptr() + first);
+  });
+  return contribution;
+}
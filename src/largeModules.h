@@ -0,0 +1,30 @@
+#ifndef __LARGEMODULES__
+#define __LARGEMODULES__
+
+#define ARMA_USE_LAPACK
+#define ARMA_USE_BLAS
+#define ARMA_NO_DEBUG
+#define ARMA_DONT_PRINT_ERRORS
+//#define ARMA_DONT_USE_CXX11
+
+#include <RcppArmadillo.h>
+#include <vector>
+#include <functional>
+
+// Modules cheaper than this (in approximate floating point operations, see 
+// 'ModuleCost') are never split across threads by default: the work would
+// not cover the cost of handing it out. See 'SetSplitMinCost'.
+#define SPLIT_MIN_COST 1e7
+// Number of tiles to split each module's work into per thread, so that 
+// uneven tiles (e.g. in 'CorrVector') still balance out.
+#define TILES_PER_THREAD 8
+
+double ModuleCost (unsigned int, unsigned int);
+void SplitModules (const std::vector<double>&, unsigned int, std::vector<unsigned int>&, std::vector<unsigned int>&);
+void ForEachModule (const std::vector<double>&, unsigned int, const std::function<void(unsigned int, unsigned int)>&);
+arma::vec SplitCorrVector (unsigned int, double *, unsigned int, unsigned int *, unsigned int);
+arma::vec SplitWeightedDegree (unsigned int, double *, unsigned int, unsigned int *, unsigned int);
+arma::vec SplitSummaryProfile (unsigned int, double *, unsigned int, unsigned int *, unsigned int);
+arma::vec SplitNodeContribution (unsigned int, double *, unsigned int, unsigned int *, unsigned int, double *);
+
+#endif // __LARGEMODULES__
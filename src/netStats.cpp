@@ -4,6 +4,12 @@
 
 #include "netStats.h"
 
+// Convergence settings for the iterative summary profile solver, see
+// 'PowerIteration'
+static const double SP_TOLERANCE = 1e-9;
+static const unsigned int SP_MAX_ITER = 200;
+static const unsigned int SP_WARMUP = 5;
+
 /* Sort nodes for sequential memory access
  *
  * When running calculations on an arbitrary sub-matrix (e.g. a module, or a
@@ -21,71 +27,106 @@
  *   order as in 'nodeIdx' prior to sorting.
  */
 arma::uvec SortNodes (unsigned int * idxAddr, unsigned int mNodes) {
-  // Construct armadillo matrices and vectors from memory addresses and 
-  // provided sizes
-  arma::uvec nodeIdx = arma::uvec(idxAddr, mNodes, false, true);
-  
-  arma::uvec rank = arma::sort_index(arma::sort_index(nodeIdx));
-  arma::uvec order = arma::sort_index(nodeIdx);
-  nodeIdx = nodeIdx(order);
+  arma::uvec rank (mNodes);
+  arma::uvec order (mNodes);
+  SortNodes(idxAddr, mNodes, rank.memptr(), order.memptr());
   return rank;
 }
 
-/* Get the complete cases for two vectors
- * 
- * Returns all indices where the element is finite in both vectors
- *
- * @param v1addr memory address of a vector.
- * @param v2addr memory address of a vector.
- * @param size size of the two vectors
+/* Sort nodes for sequential memory access without allocating
  * 
+ * @param idxAddr memory address of the module's node indices.
+ * @param mNodes number of nodes in the module.
+ * @param rankAddr memory address of a vector of length 'mNodes' to store
+ *   the ranks in.
+ * @param orderAddr memory address of a vector of length 'mNodes' to use as
+ *   scratch space.
  */
-arma::uvec CompleteCases(double * v1addr, double * v2addr, unsigned int size) {
-  arma::vec v1 = arma::vec(v1addr, size, false, true);
-  arma::vec v2 = arma::vec(v2addr, size, false, true);
-  
-  arma::uvec finites (size);
-  
-  unsigned int counter = 0;
-  for (unsigned int ii = 0; ii < size; ++ii) {
-    if (arma::is_finite(v1.at(ii)) && arma::is_finite(v2.at(ii))) {
-      finites.at(counter) = ii;
-      counter++;
+void SortNodes (
+  unsigned int * idxAddr, unsigned int mNodes, unsigned int * rankAddr,
+  unsigned int * orderAddr
+) {
+  for (unsigned int ii = 0; ii < mNodes; ++ii) {
+    orderAddr[ii] = ii;
+  }
+  std::sort(orderAddr, orderAddr + mNodes, 
+    [idxAddr](unsigned int a, unsigned int b) { 
+      return idxAddr[a] < idxAddr[b]; 
     }
+  );
+  
+  // Use 'rankAddr' to hold the sorted indices before filling in the ranks
+  for (unsigned int ii = 0; ii < mNodes; ++ii) {
+    rankAddr[ii] = idxAddr[orderAddr[ii]];
   }
-  if (counter < size) {
-    finites.resize(counter);
+  std::copy(rankAddr, rankAddr + mNodes, idxAddr);
+  for (unsigned int ii = 0; ii < mNodes; ++ii) {
+    rankAddr[orderAddr[ii]] = ii;
   }
-  
-  return finites; 
 }
 
+/* Restore the order of a results vector after 'SortNodes'
+ * 
+ * @param xAddr memory address of the vector to reorder.
+ * @param rankAddr memory address of the ranks returned by 'SortNodes'.
+ * @param mNodes number of nodes in the module.
+ * @param tmpAddr memory address of a vector of length 'mNodes' to use as
+ *   scratch space.
+ */
+void Reorder (
+  double * xAddr, unsigned int * rankAddr, unsigned int mNodes, 
+  double * tmpAddr
+) {
+  for (unsigned int ii = 0; ii < mNodes; ++ii) {
+    tmpAddr[ii] = xAddr[rankAddr[ii]];
+  }
+  std::copy(tmpAddr, tmpAddr + mNodes, xAddr);
+}
 
 /* Calculate the correlation between two vectors
-* @param v1addr memory address of a vector.
-* @param v2addr memory address of a vector.
-* @param size size of the two vectors
-*/
+ * 
+ * Only observations that are finite in both vectors are used.
+ * 
+ * @param v1addr memory address of a vector.
+ * @param v2addr memory address of a vector.
+ * @param size size of the two vectors
+ */
 double Correlation (double * v1addr, double * v2addr, unsigned int size) {
-  // Construct armadillo matrices and vectors from memory addresses and 
-  // provided sizes
-  arma::vec v1 = arma::vec(v1addr, size, false, true);
-  arma::vec v2 = arma::vec(v2addr, size, false, true);
-  
-  // Get the complete cases
-  arma::uvec cc = CompleteCases(v1addr, v2addr, size);
-  
-  if (cc.n_elem > 0) {
-    return arma::as_scalar(arma::cor(v1(cc), v2(cc)));
-  } else {
+  // First pass: means of the complete cases
+  unsigned int n = 0;
+  double m1 = 0, m2 = 0;
+  for (unsigned int ii = 0; ii < size; ++ii) {
+    if (arma::is_finite(v1addr[ii]) && arma::is_finite(v2addr[ii])) {
+      m1 += v1addr[ii];
+      m2 += v2addr[ii];
+      n++;
+    }
+  }
+  if (n == 0) {
     return arma::datum::nan;
   }
+  m1 /= n;
+  m2 /= n;
+  
+  // Second pass: (co)variances of the complete cases
+  double s12 = 0, s11 = 0, s22 = 0, d1, d2;
+  for (unsigned int ii = 0; ii < size; ++ii) {
+    if (arma::is_finite(v1addr[ii]) && arma::is_finite(v2addr[ii])) {
+      d1 = v1addr[ii] - m1;
+      d2 = v2addr[ii] - m2;
+      s12 += d1 * d2;
+      s11 += d1 * d1;
+      s22 += d2 * d2;
+    }
+  }
+  return s12 / std::sqrt(s11 * s22);
 }
 
 /* Calculate the sign-aware mean of two vectors
  * 
  * This is the mean of 'v2' where observations detract from the mean if they
- * differ in sign between 'v1' and 'v2'
+ * differ in sign between 'v1' and 'v2'. Only observations that are finite in
+ * both vectors are used.
  * 
  * @param v1addr memory address of a vector.
  * @param v2addr memory address of a vector.
@@ -93,21 +134,181 @@ double Correlation (double * v1addr, double * v2addr, unsigned int size) {
  * 
  */
 double SignAwareMean (double * v1addr, double * v2addr, unsigned int size) {
-  // Construct armadillo matrices and vectors from memory addresses and 
-  // provided sizes
-  arma::vec v1 = arma::vec(v1addr, size, false, true);
-  arma::vec v2 = arma::vec(v2addr, size, false, true);
-  
-  // Get the complete cases
-  arma::uvec cc = CompleteCases(v1addr, v2addr, size);
+  unsigned int n = 0;
+  double total = 0;
+  for (unsigned int ii = 0; ii < size; ++ii) {
+    if (arma::is_finite(v1addr[ii]) && arma::is_finite(v2addr[ii])) {
+      if (v1addr[ii] > 0) {
+        total += v2addr[ii];
+      } else if (v1addr[ii] < 0) {
+        total -= v2addr[ii];
+      }
+      n++;
+    }
+  }
   
-  if (cc.n_elem > 0) {
-    return arma::mean(arma::sign(v1(cc)) % v2(cc));
+  if (n > 0) {
+    return total / n;
   } else {
     return arma::datum::nan;
   }
 }
 
+/* Summarise a discovery vector for repeated comparison against test vectors
+ * 
+ * @param vAddr memory address of a vector.
+ * @param size size of the vector.
+ * 
+ * @return the vector's mean and sum of squared deviations, and whether all
+ *   of its elements are finite.
+ */
+Moments DiscoveryMoments (double * vAddr, std::size_t size) {
+  Moments dm;
+  dm.mean = 0;
+  dm.ss = 0;
+  for (std::size_t ii = 0; ii < size; ++ii) {
+    dm.mean += vAddr[ii];
+  }
+  dm.mean /= size;
+  for (std::size_t ii = 0; ii < size; ++ii) {
+    dm.ss += (vAddr[ii] - dm.mean) * (vAddr[ii] - dm.mean);
+  }
+  dm.finite = size > 0 && arma::is_finite(dm.mean) && arma::is_finite(dm.ss);
+  return dm;
+}
+
+/* Calculate the correlation and sign-aware mean against a discovery vector
+ * 
+ * Fast path for the permutation procedure: the discovery vector's moments 
+ * are computed once (see 'DiscoveryMoments'), so a single pass over the 
+ * test vector is enough. Non-finite values propagate through the sums, in 
+ * which case we fall back to the complete-case 'Correlation' and 
+ * 'SignAwareMean'.
+ * 
+ * @param dm moments of the discovery vector.
+ * @param dAddr memory address of the discovery vector.
+ * @param tAddr memory address of the test vector.
+ * @param size size of the two vectors.
+ * @param signMean if not NULL, the sign-aware mean is also calculated and 
+ *   stored here.
+ *   
+ * @return the correlation between the two vectors.
+ */
+double Correlation (
+  const Moments& dm, double * dAddr, double * tAddr, unsigned int size,
+  double * signMean
+) {
+  if (dm.finite && size > 0) {
+    // Shift the test vector by its first element to limit cancellation when
+    // calculating its variance.
+    double shift = tAddr[0];
+    double st = 0, stt = 0, sdt = 0, sst = 0, tt, dd;
+    for (unsigned int ii = 0; ii < size; ++ii) {
+      dd = dAddr[ii];
+      tt = tAddr[ii] - shift;
+      st += tt;
+      stt += tt * tt;
+      sdt += (dd - dm.mean) * tt;
+      sst += ((dd > 0) - (dd < 0)) * tAddr[ii];
+    }
+    if (arma::is_finite(stt) && arma::is_finite(sst)) {
+      if (signMean != NULL) {
+        *signMean = sst / size;
+      }
+      return sdt / std::sqrt(dm.ss * (stt - st * st / size));
+    }
+  }
+  if (signMean != NULL) {
+    *signMean = SignAwareMean(dAddr, tAddr, size);
+  }
+  return Correlation(dAddr, tAddr, size);
+}
+
+/* Calculate the correlations and sign-aware means of a block of test 
+ * vectors against a discovery vector
+ * 
+ * Batched form of 'Correlation' for the permutation procedure, where the 
+ * test vectors from a block of permutations are the columns of a matrix. 
+ * The cross products with the centred discovery vector (and its signs) are
+ * calculated for every column with a single matrix product, leaving only the
+ * column sums of squares to be calculated here. Columns with non-finite 
+ * values fall back to the single vector 'Correlation'.
+ * 
+ * The product always spans all 'nVec' columns, even those not requested,
+ * so that the result for a column does not depend on which other columns 
+ * are in use.
+ * 
+ * @param dm moments of the discovery vector.
+ * @param dAddr memory address of the discovery vector.
+ * @param tAddr memory address of the 'size' by 'nVec' matrix of test 
+ *   vectors. Columns not requested must still be initialised.
+ * @param size size of the discovery vector.
+ * @param nVec number of columns in the matrix of test vectors.
+ * @param first first column to calculate the correlation for.
+ * @param last one past the last column to calculate the correlation for.
+ * @param corAddr memory address of a vector of length 'nVec' to store the 
+ *   correlations in.
+ * @param signMeanAddr if not NULL, memory address of a vector of length 
+ *   'nVec' to store the sign-aware means in.
+ * @param scratchAddr memory address of at least '2*(size + nVec)' doubles to
+ *   use as scratch space.
+ */
+void BlockCorrelation (
+  const Moments& dm, double * dAddr, double * tAddr, unsigned int size,
+  unsigned int nVec, unsigned int first, unsigned int last, double * corAddr, 
+  double * signMeanAddr, double * scratchAddr
+) {
+  if (!dm.finite || size == 0) {
+    for (unsigned int jj = first; jj < last; ++jj) {
+      corAddr[jj] = Correlation(dm, dAddr, tAddr + (std::size_t)jj * size, size,
+                                signMeanAddr == NULL ? NULL : signMeanAddr + jj);
+    }
+    return;
+  }
+  
+  // The centred discovery vector, and its signs if the sign-aware means are
+  // needed.
+  const unsigned int nCols = signMeanAddr == NULL ? 1 : 2;
+  arma::mat disc (scratchAddr, size, nCols, false, true);
+  double dd;
+  for (unsigned int ii = 0; ii < size; ++ii) {
+    dd = dAddr[ii];
+    disc.at(ii, 0) = dd - dm.mean;
+    if (nCols == 2) {
+      disc.at(ii, 1) = (dd > 0) - (dd < 0);
+    }
+  }
+  arma::mat tests (tAddr, size, nVec, false, true);
+  arma::mat cross (scratchAddr + 2 * size, nVec, nCols, false, true);
+  cross = tests.t() * disc;
+  
+  double * tt;
+  double shift, st, stt, dt;
+  for (unsigned int jj = first; jj < last; ++jj) {
+    // Shift the test vector by its first element to limit cancellation when
+    // calculating its variance.
+    tt = tAddr + (std::size_t)jj * size;
+    shift = tt[0];
+    st = 0;
+    stt = 0;
+    for (unsigned int ii = 0; ii < size; ++ii) {
+      dt = tt[ii] - shift;
+      st += dt;
+      stt += dt * dt;
+    }
+    if (arma::is_finite(stt) && arma::is_finite(cross.at(jj, 0)) &&
+        arma::is_finite(cross.at(jj, nCols - 1))) {
+      corAddr[jj] = cross.at(jj, 0) / std::sqrt(dm.ss * (stt - st * st / size));
+      if (signMeanAddr != NULL) {
+        signMeanAddr[jj] = cross.at(jj, 1) / size;
+      }
+    } else {
+      corAddr[jj] = Correlation(dm, dAddr, tt, size, 
+                                signMeanAddr == NULL ? NULL : signMeanAddr + jj);
+    }
+  }
+}
+
 /* Calculate the weighted degree of a module
  *
  * The weighted degree is the sum of edge weights to all other nodes in the
@@ -125,24 +326,62 @@ arma::vec WeightedDegree(
     double * netAddr, unsigned int nNodes, unsigned int * idxAddr, 
     unsigned int mNodes 
 ) {
-  // Construct armadillo matrices and vectors from memory addresses and 
-  // provided sizes
-  arma::mat net = arma::mat(netAddr, nNodes, nNodes, false, true);
-  arma::uvec nodeIdx = arma::uvec(idxAddr, mNodes, false, true);
-  
-  // We take the absolute value so that negative weights (if they exist) do not
-  // cancel out positive ones
-  arma::rowvec colSums = arma::sum(arma::abs(net(nodeIdx, nodeIdx)), 0);
-  // We need to convert to a column-vector
-  // Note to self: do not set copy_aux_memory to false! The program may free
-  // the memory used in the returned vector to be used elsewhere!
-  arma::vec wDegree = arma::vec(colSums.begin(), colSums.n_elem, true);
-  // subtract the diagonals
-  arma::vec dg = net.diag(0);
-  wDegree -= arma::abs(dg.elem(nodeIdx));
+  arma::vec wDegree (mNodes);
+  WeightedDegree(netAddr, nNodes, idxAddr, mNodes, wDegree.memptr());
   return wDegree;
 }
 
+/* Calculate the weighted degree of a module without allocating
+ * 
+ * @param netAddr address of the network's adjacency matrix in memory.
+ * @param nNodes number of nodes in the network.
+ * @param idxAddr memory address of ascending-order sorted indices of the 
+ *  module's nodes.
+ * @param mNodes number of nodes in the module.
+ * @param wdAddr memory address of a vector of length 'mNodes' to store the
+ *  weighted degree in.
+ */
+void WeightedDegree(
+    double * netAddr, unsigned int nNodes, unsigned int * idxAddr, 
+    unsigned int mNodes, double * wdAddr
+) {
+  WeightedDegreeTile(netAddr, nNodes, idxAddr, mNodes, 0, mNodes, wdAddr);
+}
+
+/* Calculate the weighted degree of a range of a module's nodes
+ * 
+ * Allows the weighted degree of a large module to be split across threads.
+ * 
+ * @param netAddr address of the network's adjacency matrix in memory.
+ * @param nNodes number of nodes in the network.
+ * @param idxAddr memory address of ascending-order sorted indices of the 
+ *  module's nodes.
+ * @param mNodes number of nodes in the module.
+ * @param first the first node in the range.
+ * @param last one past the last node in the range.
+ * @param wdAddr memory address of a vector of length 'mNodes' to store the
+ *  weighted degree in. Only elements 'first' to 'last - 1' are written.
+ */
+void WeightedDegreeTile(
+    double * netAddr, unsigned int nNodes, unsigned int * idxAddr, 
+    unsigned int mNodes, unsigned int first, unsigned int last, double * wdAddr
+) {
+  double * col;
+  double total;
+  for (unsigned int jj = first; jj < last; ++jj) {
+    col = netAddr + (std::size_t)idxAddr[jj] * nNodes;
+    total = 0;
+    // We take the absolute value so that negative weights (if they exist) do
+    // not cancel out positive ones, and skip the diagonal.
+    for (unsigned int ii = 0; ii < mNodes; ++ii) {
+      if (ii != jj) {
+        total += std::abs(col[idxAddr[ii]]);
+      }
+    }
+    wdAddr[jj] = total;
+  }
+}
+
 /* Calculate the average edge weight
  *
  * @param wDegreeAddr memory address of the weighted degree vector, see 
@@ -156,7 +395,7 @@ double AverageEdgeWeight(double * wDegreeAddr, unsigned int mNodes) {
   // provided sizes
   arma::vec wDegree = arma::vec(wDegreeAddr, mNodes, false, true);
   
-  double nEdgePairs = (double)(mNodes*mNodes - mNodes);
+  double nEdgePairs = (double)mNodes * mNodes - mNodes;
   double allEdges =  arma::as_scalar(arma::sum(wDegree));
   return allEdges / nEdgePairs;
 }
@@ -177,37 +416,191 @@ arma::vec CorrVector (
   double * corrAddr, unsigned int nNodes, unsigned int * idxAddr, 
   unsigned int mNodes
 ) {
-  // Construct armadillo matrices and vectors from memory addresses and 
-  // provided sizes
-  arma::mat corr = arma::mat(corrAddr, nNodes, nNodes, false, true);
-  arma::uvec nodeIdx = arma::uvec(idxAddr, mNodes, false, true);
-  
-  // Number of nodes in the requested sub-matrix
-  unsigned int n = nodeIdx.n_elem;
-  
-  // We need to flatten the matrices to a vector, ignoring the diagonals.
-  unsigned int flatsize = (n*n - n)/2;
-  arma::vec corrVec(flatsize);
-  
-  unsigned int vi = 0;  // keeps track of position in corrVec
+  arma::vec corrVec (((std::size_t)mNodes * mNodes - mNodes) / 2);
+  CorrVector(corrAddr, nNodes, idxAddr, mNodes, corrVec.memptr());
+  return corrVec;
+}
+
+/* Get a vector of correlation coefficients for a module without allocating
+ * 
+ * @param corrAddr address in memory of the matrix of correlation coefficients.
+ * @param nNodes number of nodes in the correlation matrix. 
+ * @param idxAddr memory address of the indices of the module's nodes.
+ * @param mNodes number of nodes in the module.
+ * @param cvAddr memory address of a vector of length 
+ *   '(mNodes*mNodes - mNodes)/2' to store the correlation coefficients in.
+ */
+void CorrVector (
+  double * corrAddr, unsigned int nNodes, unsigned int * idxAddr, 
+  unsigned int mNodes, double * cvAddr
+) {
+  CorrVectorTile(corrAddr, nNodes, idxAddr, mNodes, 0, mNodes, cvAddr);
+}
+
+/* Get the correlation coefficients for a range of a module's columns
+ * 
+ * Allows the correlation vector of a large module to be split across 
+ * threads.
+ * 
+ * @param corrAddr address in memory of the matrix of correlation coefficients.
+ * @param nNodes number of nodes in the correlation matrix. 
+ * @param idxAddr memory address of the indices of the module's nodes.
+ * @param mNodes number of nodes in the module.
+ * @param first the first column of the module's sub-matrix in the range.
+ * @param last one past the last column in the range.
+ * @param cvAddr memory address of the module's whole correlation vector, see
+ *   'CorrVector'. Only the coefficients below the diagonal in columns 
+ *   'first' to 'last - 1' are written.
+ */
+void CorrVectorTile (
+  double * corrAddr, unsigned int nNodes, unsigned int * idxAddr, 
+  unsigned int mNodes, unsigned int first, unsigned int last, double * cvAddr
+) {
+  // Column 'jj' starts after the 'mNodes - 1 - kk' coefficients of each 
+  // column 'kk' before it.
+  std::size_t vi = (std::size_t)first * (mNodes - 1) - 
+    (std::size_t)first * (first - 1) / 2; 
+  double * col;
   
-  // Iterate over columns and rows to fill out 'corrVec' with the lower 
+  // Iterate over columns and rows to fill out 'cvAddr' with the lower 
   // triangle of the submatrix.
-  for (unsigned int jj = 0; jj < n; jj++) {
-    for (unsigned int ii = jj + 1; ii < n; ii++) {
-      corrVec.at(vi) = corr(nodeIdx(ii), nodeIdx(jj));
+  for (unsigned int jj = first; jj < last; jj++) {
+    col = corrAddr + (std::size_t)idxAddr[jj] * nNodes;
+    for (unsigned int ii = jj + 1; ii < mNodes; ii++) {
+      cvAddr[vi] = col[idxAddr[ii]];
       vi++;
     }   
   }
+}
+
+/* Get the correlation structure statistics and weighted degree of a module
+ * in one pass
+ * 
+ * Fused, streaming version of 'CorrVector', 'WeightedDegree', 'Correlation' 
+ * and 'SignAwareMean' for the permutation procedure. Each pair of nodes is 
+ * visited once, in ascending order of their indices, reading the correlation
+ * and network matrices column by column. The correlation coefficient of each
+ * pair is compared to the corresponding element of the discovery correlation
+ * vector on the fly, accumulating the sufficient statistics for "cor.cor" 
+ * and "avg.cor", so the module's test correlation vector is never stored. 
+ * As in 'WeightedDegree', the weighted degree of each node is the sum of its
+ * column, so each pair adds the weight in one direction to one node and the
+ * weight in the other direction to the other node, and directed networks 
+ * give the same weighted degree as the observed statistics.
+ * 
+ * As in 'Correlation' and 'SignAwareMean', only pairs where both coefficients
+ * are finite are used.
+ * 
+ * 'CORR' and 'DEGREE' select which of the two halves to calculate, so that
+ * the permutation procedure does not read a matrix it has no statistics 
+ * for. The other half's outputs are left untouched.
+ * 
+ * @param corrAddr address in memory of the matrix of correlation coefficients.
+ * @param netAddr address of the network's adjacency matrix in memory.
+ * @param nNodes number of nodes in the correlation and network matrices. 
+ * @param idxAddr memory address of ascending-order sorted indices of the 
+ *  module's nodes, see 'SortNodes'.
+ * @param orderAddr memory address of the original position of each sorted
+ *  index, as left in the scratch space by 'SortNodes'.
+ * @param mNodes number of nodes in the module.
+ * @param dm moments of the discovery correlation vector, see 
+ *   'DiscoveryMoments'.
+ * @param dcvAddr memory address of the discovery correlation vector, in the
+ *   order 'CorrVector' returns for the indices prior to sorting.
+ * @param wdAddr memory address of a vector of length 'mNodes' to store the
+ *   weighted degree in, in the order of the indices prior to sorting.
+ * @param startAddr memory address of a vector of length 'mNodes' to use as
+ *   scratch space.
+ * @param corCor variable to store the correlation between the discovery and 
+ *   test correlation coefficients in.
+ * @param avgCor variable to store the sign-aware mean of the test correlation
+ *   coefficients in.
+ */
+template <bool CORR, bool DEGREE>
+void CorrAndDegree (
+  double * corrAddr, double * netAddr, unsigned int nNodes, 
+  unsigned int * idxAddr, unsigned int * orderAddr, unsigned int mNodes, 
+  const Moments& dm, double * dcvAddr, double * wdAddr, 
+  std::size_t * startAddr, double& corCor, double& avgCor
+) {
+  // Position in 'dcvAddr' of the first pair in each column of the lower 
+  // triangle, in the original node order.
+  for (unsigned int jj = 0; jj < mNodes; ++jj) {
+    if (CORR) {
+      startAddr[jj] = (std::size_t)jj * mNodes - ((std::size_t)jj * jj + jj) / 2;
+    }
+    if (DEGREE) {
+      wdAddr[jj] = 0;
+    }
+  }
   
-  return corrVec;
+  // Shift the discovery coefficients by their mean (where known) to limit 
+  // cancellation in the sums of squares. 
+  double shift = dm.finite ? dm.mean : 0;
+  std::size_t n = 0;
+  double sd = 0, st = 0, sdd = 0, stt = 0, sdt = 0, sst = 0;
+  
+  double * corrCol;
+  double * netCol;
+  double dd, tt;
+  unsigned int oa, ob, lo, hi;
+  for (unsigned int aa = 0; aa < mNodes; ++aa) {
+    corrCol = corrAddr + (std::size_t)idxAddr[aa] * nNodes;
+    netCol = netAddr + (std::size_t)idxAddr[aa] * nNodes;
+    oa = orderAddr[aa];
+    for (unsigned int bb = aa + 1; bb < mNodes; ++bb) {
+      ob = orderAddr[bb];
+      if (CORR) {
+        if (oa < ob) {
+          lo = oa; hi = ob;
+        } else {
+          lo = ob; hi = oa;
+        }
+        dd = dcvAddr[startAddr[lo] + hi - lo - 1];
+        tt = corrCol[idxAddr[bb]];
+        if (arma::is_finite(dd) && arma::is_finite(tt)) {
+          sst += ((dd > 0) - (dd < 0)) * tt;
+          dd -= shift;
+          sd += dd;
+          st += tt;
+          sdd += dd * dd;
+          stt += tt * tt;
+          sdt += dd * tt;
+          n++;
+        }
+      }
+      
+      if (DEGREE) {
+        // We take the absolute value so that negative weights (if they  
+        // exist) do not cancel out positive ones
+        wdAddr[oa] += std::abs(netCol[idxAddr[bb]]);
+        wdAddr[ob] += std::abs(
+          netAddr[(std::size_t)idxAddr[bb] * nNodes + idxAddr[aa]]);
+      }
+    }
+  }
+  
+  if (!CORR) {
+    return;
+  }
+  if (n > 0) {
+    corCor = (sdt - sd * st / n) / std::sqrt((sdd - sd * sd / n) * (stt - st * st / n));
+    avgCor = sst / n;
+  } else {
+    corCor = arma::datum::nan;
+    avgCor = arma::datum::nan;
+  }
 }
 
+// The combinations used by the permutation procedure
+template void CorrAndDegree<true, true> (double *, double *, unsigned int, unsigned int *, unsigned int *, unsigned int, const Moments&, double *, double *, std::size_t *, double&, double&);
+template void CorrAndDegree<true, false> (double *, double *, unsigned int, unsigned int *, unsigned int *, unsigned int, const Moments&, double *, double *, std::size_t *, double&, double&);
+template void CorrAndDegree<false, true> (double *, double *, unsigned int, unsigned int *, unsigned int *, unsigned int, const Moments&, double *, double *, std::size_t *, double&, double&);
+
 /* Calculate the summary profile of a module
  * 
  * @param dataAddr address of the data matrix in memory.
  * @param nSamples number of samples in the data matrix.
- * @param nNodes number of nodes in the the data matrix.
  * @param idxAddr memory address of the ascending-order sorted indices of the 
  *  module's nodes.
  * @param mNodes number of nodes in the module.
@@ -215,45 +608,301 @@ arma::vec CorrVector (
  * @return a vector of observations across samples
  */
 arma::vec SummaryProfile (
-  double * dataAddr, unsigned int nSamples, unsigned int nNodes,  
-  unsigned int * idxAddr, unsigned int mNodes
+  double * dataAddr, unsigned int nSamples, unsigned int * idxAddr, 
+  unsigned int mNodes
 ) {
-  // Construct armadillo matrices and vectors from memory addresses and 
-  // provided sizes
-  arma::mat data = arma::mat(dataAddr, nSamples, nNodes, false, true);
-  arma::uvec nodeIdx = arma::uvec(idxAddr, mNodes, false ,true);
+  arma::vec summary (nSamples);
+  SVDScratch scratch;
+  SummaryProfile(dataAddr, nSamples, idxAddr, mNodes, summary.memptr(), 
+                 scratch);
+  return summary;
+}
+
+/* Gather a module's data into the scratch matrix
+ * 
+ * 'scratch.sub' is only reallocated if it is too small to hold the module.
+ *
+ * @param dataAddr address of the data matrix in memory.
+ * @param nSamples number of samples in the data matrix.
+ * @param idxAddr memory address of the indices of the module's nodes.
+ * @param mNodes number of nodes in the module.
+ * @param scratch matrices reused between calls, see 'SVDScratch'.
+ */
+static void GatherModule (
+  double * dataAddr, unsigned int nSamples, unsigned int * idxAddr, 
+  unsigned int mNodes, SVDScratch& scratch
+) {
+  if (scratch.sub.n_elem < (std::size_t)nSamples * mNodes) {
+    scratch.sub.set_size(nSamples, mNodes);
+  }
+  double * dest = scratch.sub.memptr();
+  for (unsigned int jj = 0; jj < mNodes; ++jj) {
+    std::copy(dataAddr + (std::size_t)idxAddr[jj] * nSamples, 
+              dataAddr + ((std::size_t)idxAddr[jj] + 1) * nSamples,
+              dest + (std::size_t)jj * nSamples);
+  }
+}
+
+/* Get the first left singular vector of a module's data
+ * 
+ * Only the first left singular vector is needed, so the cheaper iterative
+ * solver is tried first if requested (see 'SVDScratch'), falling back to
+ * the LAPACK SVD.
+ * 
+ * @param modData the module's data, see 'GatherModule'.
+ * @param uAddr memory address of a vector of length 'modData.n_rows' to 
+ *   store the singular vector in. Its sign is arbitrary.
+ * @param scratch matrices reused between calls, see 'SVDScratch'.
+ * 
+ * @return false if the decomposition failed.
+ */
+static bool FirstLeftSingularVector (
+  const arma::mat& modData, double * uAddr, SVDScratch& scratch
+) {
+  if (scratch.iterative && LeadingSingularVector(modData, uAddr, scratch)) {
+    return true;
+  }
+  bool success = arma::svd_econ(scratch.U, scratch.S, scratch.V, modData, 
+                                "left", "dc");
+  if (success) {
+    std::copy(scratch.U.colptr(0), scratch.U.colptr(0) + modData.n_rows, uAddr);
+  }
+  return success;
+}
+
+/* Calculate the summary profile of a module, reusing scratch memory
+ * 
+ * @param dataAddr address of the data matrix in memory.
+ * @param nSamples number of samples in the data matrix.
+ * @param idxAddr memory address of the ascending-order sorted indices of the 
+ *  module's nodes.
+ * @param mNodes number of nodes in the module.
+ * @param summaryAddr memory address of a vector of length 'nSamples' to
+ *  store the summary profile in.
+ * @param scratch matrices reused between calls, see 'SVDScratch'.
+ */
+void SummaryProfile (
+  double * dataAddr, unsigned int nSamples, unsigned int * idxAddr, 
+  unsigned int mNodes, double * summaryAddr, SVDScratch& scratch
+) {
+  GatherModule(dataAddr, nSamples, idxAddr, mNodes, scratch);
+  arma::mat modData = arma::mat(scratch.sub.memptr(), nSamples, mNodes, false, true);
+  
+  if (!FirstLeftSingularVector(modData, summaryAddr, scratch)) {
+    std::fill(summaryAddr, summaryAddr + nSamples, arma::datum::nan);
+    return;
+  }
+  OrientSummaryProfile(modData, summaryAddr);
+}
+
+/* Flip the sign of the summary profile so that the eigenvector is 
+ * positively correlated with the average scaled value of the underlying
+ * data for the network module. Only the sign of their covariance is 
+ * needed for this.
+ * 
+ * @param modData the module's data, see 'GatherModule'.
+ * @param summaryAddr memory address of the summary profile vector.
+ */
+void OrientSummaryProfile (const arma::mat& modData, double * summaryAddr) {
+  unsigned int nSamples = modData.n_rows;
+  unsigned int mNodes = modData.n_cols;
+  double meanSummary = 0;
+  for (unsigned int ss = 0; ss < nSamples; ++ss) {
+    meanSummary += summaryAddr[ss];
+  }
+  meanSummary /= nSamples;
+  
+  double meanObs, covariance = 0;
+  for (unsigned int ss = 0; ss < nSamples; ++ss) {
+    meanObs = 0;
+    for (unsigned int jj = 0; jj < mNodes; ++jj) {
+      meanObs += modData.at(ss, jj);
+    }
+    meanObs /= mNodes;
+    covariance += meanObs * (summaryAddr[ss] - meanSummary);
+  }
+
+  if (covariance < 0) {
+    for (unsigned int ss = 0; ss < nSamples; ++ss) {
+      summaryAddr[ss] *= -1;
+    }
+  }
+}
+
+/* Find the leading left singular vector of a matrix by power iteration
+ * 
+ * Iterates on the cross-product of 'X' along its smaller dimension, starting 
+ * from the direction of the row sums of 'X' (i.e. the average profile), 
+ * which is typically close to the leading singular vector for a module.
+ * 
+ * @param X the matrix to decompose.
+ * @param uAddr memory address of a vector of length 'X.n_rows' to store the
+ *   singular vector in. Its sign is arbitrary.
+ * @param scratch matrices reused between calls, see 'SVDScratch'.
+ * 
+ * @return true if the iteration converged within 'SP_MAX_ITER' iterations.
+ *   If not, the contents of 'uAddr' are undefined.
+ */
+bool LeadingSingularVector (
+  const arma::mat& X, double * uAddr, SVDScratch& scratch
+) {
+  arma::vec u = arma::vec(uAddr, X.n_rows, false, true);
   
-  arma::mat U, V;
-  arma::vec S;
+  // Work with the smaller of X X' and X' X. In the latter case we find the
+  // leading right singular vector, and map it back through X.
+  bool wide = X.n_rows <= X.n_cols;
+  if (wide) {
+    scratch.gram = X * X.t();
+    scratch.x = arma::sum(X, 1);
+  } else {
+    scratch.gram = X.t() * X;
+    scratch.x.ones(X.n_cols);
+  }
+  if (!PowerIteration(scratch)) {
+    return false;
+  }
+  
+  if (wide) {
+    u = scratch.x;
+  } else {
+    u = X * scratch.x;
+    u /= arma::norm(u);
+  }
+  return true;
+}
+
+/* Find the leading eigenvector of a cross-product matrix by power iteration
+ * 
+ * The iterates have unit norm, so 'SP_TOLERANCE' bounds the relative change
+ * in the eigenvector between iterations. The change shrinks by the ratio of
+ * the second to the leading eigenvalue at each iteration, so after a few 
+ * warm-up iterations we use the observed ratio to predict how many more are
+ * needed. When the two leading eigenvalues are too close for that to fit in
+ * 'SP_MAX_ITER' iterations we give up straight away so that the caller can 
+ * fall back to the LAPACK SVD.
+ * 
+ * @param scratch holds the cross-product in 'gram' and the starting vector
+ *   in 'x', which need not be normalised. On success, 'x' holds the 
+ *   eigenvector with unit norm. See 'SVDScratch'.
+ * 
+ * @return true if the iteration converged within 'SP_MAX_ITER' iterations.
+ */
+bool PowerIteration (SVDScratch& scratch) {
+  scratch.y.set_size(scratch.x.n_elem);
   
-  bool success = arma::svd_econ(U, S, V, data.cols(nodeIdx), "left", "dc");
+  double norm = arma::norm(scratch.x);
+  if (!(norm > 0) || !arma::is_finite(norm)) {
+    return false;
+  }
+  scratch.x /= norm;
   
-  if (!success) {
-    arma::vec summary (nSamples);
+  double step, prevStep = 0, rate, dd;
+  for (unsigned int iter = 0; iter < SP_MAX_ITER; ++iter) {
+    scratch.y = scratch.gram * scratch.x;
+    norm = arma::norm(scratch.y);
+    if (!(norm > 0) || !arma::is_finite(norm)) {
+      return false;
+    }
+    scratch.y /= norm;
+    
+    // The cross-product is positive semi-definite, so the iterates do not
+    // flip sign and can be compared directly.
+    step = 0;
+    for (unsigned int ii = 0; ii < scratch.x.n_elem; ++ii) {
+      dd = scratch.y.at(ii) - scratch.x.at(ii);
+      step += dd * dd;
+    }
+    step = std::sqrt(step);
+    scratch.x.swap(scratch.y);
+    if (step < SP_TOLERANCE) {
+      return true;
+    }
+    
+    // Estimate the eigengap from the rate of convergence so far
+    if (iter >= SP_WARMUP && prevStep > 0) {
+      rate = step / prevStep;
+      if (rate >= 1 || 
+          iter + std::log(SP_TOLERANCE / step) / std::log(rate) >= SP_MAX_ITER) {
+        return false;
+      }
+    }
+    prevStep = step;
+  }
+  return false;
+}
+
+/* Calculate the summary profile, node contributions, and coherence of a 
+ * module in one pass over its data
+ * 
+ * Equivalent to calling 'SummaryProfile', 'NodeContribution', and 
+ * 'ModuleCoherence' in turn, but the module's data is only gathered once. 
+ * Since 'Scale' has already standardised each node to mean 0 and standard 
+ * deviation 1, the correlation between each node and the summary profile 
+ * 'u' is 'X'u / (sqrt(n - 1) * ||u - mean(u)||)', so all node contributions 
+ * come from a single matrix-vector product. The average scaled profile of 
+ * the module's nodes covaries with 'u' in proportion to the sum of the node 
+ * contributions, which gives the orientation of the summary profile for 
+ * free.
+ *
+ * @param dataAddr address of the scaled data matrix in memory.
+ * @param nSamples number of samples in the data matrix.
+ * @param idxAddr memory address of the ascending-order sorted indices of the 
+ *  module's nodes.
+ * @param mNodes number of nodes in the module.
+ * @param summaryAddr memory address of a vector of length 'nSamples' to
+ *  store the summary profile in.
+ * @param ncAddr memory address of a vector of length 'mNodes' to store the
+ *  node contributions in, in the same order as 'idxAddr'.
+ * @param scratch matrices reused between calls, see 'SVDScratch'.
+ * 
+ * @return the module coherence.
+ */
+double SummaryAndContribution (
+  double * dataAddr, unsigned int nSamples, unsigned int * idxAddr, 
+  unsigned int mNodes, double * summaryAddr, double * ncAddr, 
+  SVDScratch& scratch
+) {
+  GatherModule(dataAddr, nSamples, idxAddr, mNodes, scratch);
+  arma::mat modData = arma::mat(scratch.sub.memptr(), nSamples, mNodes, false, true);
+  arma::vec summary = arma::vec(summaryAddr, nSamples, false, true);
+  arma::vec contribution = arma::vec(ncAddr, mNodes, false, true);
+  
+  if (!FirstLeftSingularVector(modData, summaryAddr, scratch)) {
     summary.fill(arma::datum::nan);
-    return summary;
+    contribution.fill(arma::datum::nan);
+    return arma::datum::nan;
+  }
+  
+  contribution = modData.t() * summary;
+  
+  double meanSummary = 0, ssSummary = 0, total = 0;
+  for (unsigned int ss = 0; ss < nSamples; ++ss) {
+    meanSummary += summaryAddr[ss];
+  }
+  meanSummary /= nSamples;
+  for (unsigned int ss = 0; ss < nSamples; ++ss) {
+    ssSummary += (summaryAddr[ss] - meanSummary) * (summaryAddr[ss] - meanSummary);
+  }
+  for (unsigned int jj = 0; jj < mNodes; ++jj) {
+    total += ncAddr[jj];
   }
-  arma::vec summary = U.col(0);
   
-  /* Flip the sign of the summary profile so that the eigenvector is 
-   * positively correlated with the average scaled value of the underlying
-   * data for the network module.
-   */
-  arma::vec meanObs = arma::mean(data.cols(nodeIdx), 1);
-  int orientation = arma::as_scalar(arma::sign(arma::cor(meanObs, summary)));
-
-  if (orientation == -1) {
+  // Flip the sign of the summary profile so that it is positively correlated
+  // with the average scaled value of the module's nodes.
+  double norm = 1 / std::sqrt((nSamples - 1) * ssSummary);
+  if (total < 0) {
     summary *= -1;
+    norm *= -1;
   }
+  contribution *= norm;
   
-  return summary;
+  return ModuleCoherence(ncAddr, mNodes);
 }
 
 /* Calculate the contribution of each node to the summary profile
  *
  * @param dataAddr address in memory of the data matrix.
  * @param nSamples number of samples in the data matrix and summar profile.
- * @param nNodes number of nodes in the network.
  * @param idxAddr memory address of the  ascending-order sorted indices of the 
  *  module's nodes.
  * @param mNodes number of nodes in the module.
@@ -263,20 +912,61 @@ arma::vec SummaryProfile (
  * @return a vector of correlations between each node and the summary profile
  */
 arma::vec NodeContribution (
-  double * dataAddr, unsigned int nSamples, unsigned int nNodes, 
-  unsigned int * idxAddr, unsigned int mNodes, double * summaryAddr
+  double * dataAddr, unsigned int nSamples, unsigned int * idxAddr, 
+  unsigned int mNodes, double * summaryAddr
 ) {
-  // Construct armadillo matrices and vectors from memory addresses and 
-  // provided sizes
-  arma::mat data = arma::mat(dataAddr, nSamples, nNodes, false, true);
-  arma::uvec nodeIdx = arma::uvec(idxAddr, mNodes, false, true);
-  
-  // We need the summary profile in a matrix format rather than a vector 
-  // because arma::cor doesn't have a method for comparing a matrix to a 
-  // vector.
-  arma::mat summary = arma::mat(summaryAddr, nSamples, 1, false, true);
+  arma::vec contribution (mNodes);
+  NodeContribution(dataAddr, nSamples, idxAddr, mNodes, summaryAddr,
+                   contribution.memptr());
+  return contribution;
+}
+
+/* Calculate the contribution of each node to the summary profile without
+ * allocating
+ * 
+ * @param dataAddr address in memory of the data matrix.
+ * @param nSamples number of samples in the data matrix and summar profile.
+ * @param idxAddr memory address of the  ascending-order sorted indices of the 
+ *  module's nodes.
+ * @param mNodes number of nodes in the module.
+ * @param summaryAddr memory address of the summary profile vector, see 
+ *  'SummaryProfile'.
+ * @param ncAddr memory address of a vector of length 'mNodes' to store the
+ *  node contributions in.
+ */
+void NodeContribution (
+  double * dataAddr, unsigned int nSamples, unsigned int * idxAddr, 
+  unsigned int mNodes, double * summaryAddr, double * ncAddr
+) {
+  // Centre the summary profile once, then correlate each node against it.
+  double meanSummary = 0, ssSummary = 0;
+  for (unsigned int ss = 0; ss < nSamples; ++ss) {
+    meanSummary += summaryAddr[ss];
+  }
+  meanSummary /= nSamples;
+  for (unsigned int ss = 0; ss < nSamples; ++ss) {
+    ssSummary += (summaryAddr[ss] - meanSummary) * (summaryAddr[ss] - meanSummary);
+  }
   
-  return arma::cor(data.cols(nodeIdx), summary);
+  double * col;
+  double meanNode, ssNode, crossProd, dd;
+  for (unsigned int jj = 0; jj < mNodes; ++jj) {
+    col = dataAddr + (std::size_t)idxAddr[jj] * nSamples;
+    meanNode = 0;
+    for (unsigned int ss = 0; ss < nSamples; ++ss) {
+      meanNode += col[ss];
+    }
+    meanNode /= nSamples;
+    
+    ssNode = 0;
+    crossProd = 0;
+    for (unsigned int ss = 0; ss < nSamples; ++ss) {
+      dd = col[ss] - meanNode;
+      ssNode += dd * dd;
+      crossProd += dd * (summaryAddr[ss] - meanSummary);
+    }
+    ncAddr[jj] = crossProd / std::sqrt(ssNode * ssSummary);
+  }
 }
 
 /* Calculate module's coherence
@@ -293,15 +983,36 @@ arma::vec NodeContribution (
 double ModuleCoherence (double * ncAddr, unsigned int mNodes) {
   // Construct armadillo matrices and vectors from memory addresses and 
   // provided sizes
-  arma::vec contribution = arma::vec(ncAddr, mNodes, false, true);
-  
-  arma::uvec cc = arma::find_finite(contribution);
+  unsigned int n = 0;
+  double total = 0;
+  for (unsigned int ii = 0; ii < mNodes; ++ii) {
+    if (arma::is_finite(ncAddr[ii])) {
+      total += ncAddr[ii] * ncAddr[ii];
+      n++;
+    }
+  }
   
-  if (cc.n_elem > 0) {
-    return arma::mean(arma::square(contribution(cc)));
+  if (n > 0) {
+    return total / n;
   } else {
     return arma::datum::nan;
   }
 }
 
-
+/* Allocate a workspace large enough for any module of up to 'maxNodes' nodes
+ * 
+ * @param maxNodes number of nodes in the largest module.
+ * @param nSamples number of samples in the data matrix, or 0 if the data 
+ *   matrix is not being used.
+ */
+Workspace::Workspace (unsigned int maxNodes, unsigned int nSamples) :
+  idx(maxNodes), rank(maxNodes), order(maxNodes), start(maxNodes), 
+  wd(maxNodes), nc(maxNodes), sp(nSamples), tmp(maxNodes)
+{
+  if (nSamples > 0) {
+    svd.sub.set_size(nSamples, maxNodes);
+  }
+  // The permutation procedure only needs the summary profile to compute the
+  // null distributions, so use the faster iterative solver
+  svd.iterative = true;
+}
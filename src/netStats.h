@@ -8,18 +8,80 @@
 //#define ARMA_DONT_USE_CXX11
 
 #include <RcppArmadillo.h>
+#include <algorithm>
+
+/* Scratch matrices reused by 'SummaryProfile' between calls
+ * 
+ * If 'iterative' is true, 'SummaryProfile' first tries to find the leading
+ * singular vector by power iteration (see 'LeadingSingularVector'), and only
+ * falls back to the full LAPACK SVD if that does not converge.
+ */
+struct SVDScratch {
+  SVDScratch () : iterative(false) {}
+  bool iterative;
+  arma::mat sub; // the module's data
+  arma::mat U, V; 
+  arma::vec S;
+  arma::mat gram; // cross-product of 'sub' along its smaller dimension
+  arma::vec x, y; // power iteration vectors
+};
+
+/* Moments of a discovery vector, see 'DiscoveryMoments'
+ */
+struct Moments {
+  Moments () : finite(false), mean(0), ss(0) {}
+  bool finite; // are all elements finite?
+  double mean;
+  double ss; // sum of squared deviations from the mean
+};
+
+/* Per-thread memory for calculating a module's properties
+ * 
+ * Sized once for the largest module so that the permutation procedure does
+ * not allocate any memory once it has started. The kernels below write into
+ * the first 'mNodes' elements of each buffer. Nothing here scales with the
+ * number of node pairs in a module, see 'CorrAndDegree'.
+ */
+struct Workspace {
+  Workspace (unsigned int, unsigned int);
+  arma::uvec idx; // node indices in the test dataset
+  arma::uvec rank; // see 'SortNodes'
+  arma::uvec order; // scratch space for 'SortNodes'
+  std::vector<std::size_t> start; // scratch space for 'CorrAndDegree'
+  arma::vec wd; // weighted degree
+  arma::vec nc; // node contribution
+  arma::vec sp; // summary profile
+  arma::vec tmp; // scratch space for 'Reorder'
+  SVDScratch svd;
+};
 
 // Utility functions
 arma::uvec SortNodes (unsigned int *, unsigned int);
+void SortNodes (unsigned int *, unsigned int, unsigned int *, unsigned int *);
+void Reorder (double *, unsigned int *, unsigned int, double *);
 double Correlation (double *, double *, unsigned int);
 double SignAwareMean (double *, double *, unsigned int);
+Moments DiscoveryMoments (double *, std::size_t);
+double Correlation (const Moments&, double *, double *, unsigned int, double *);
+void BlockCorrelation (const Moments&, double *, double *, unsigned int, unsigned int, unsigned int, unsigned int, double *, double *, double *);
 
 // Network properties
 arma::vec WeightedDegree (double *, unsigned int, unsigned int *, unsigned int);
+void WeightedDegree (double *, unsigned int, unsigned int *, unsigned int, double *);
+void WeightedDegreeTile (double *, unsigned int, unsigned int *, unsigned int, unsigned int, unsigned int, double *);
 double AverageEdgeWeight (double *, unsigned int);
 arma::vec CorrVector (double *, unsigned int, unsigned int *, unsigned int);
-arma::vec SummaryProfile (double *, unsigned int, unsigned int, unsigned int *, unsigned int);
-arma::vec NodeContribution (double *, unsigned int, unsigned int, unsigned int *, unsigned int, double *);
+void CorrVector (double *, unsigned int, unsigned int *, unsigned int, double *);
+void CorrVectorTile (double *, unsigned int, unsigned int *, unsigned int, unsigned int, unsigned int, double *);
+template <bool CORR, bool DEGREE> void CorrAndDegree (double *, double *, unsigned int, unsigned int *, unsigned int *, unsigned int, const Moments&, double *, double *, std::size_t *, double&, double&);
+arma::vec SummaryProfile (double *, unsigned int, unsigned int *, unsigned int);
+void SummaryProfile (double *, unsigned int, unsigned int *, unsigned int, double *, SVDScratch&);
+void OrientSummaryProfile (const arma::mat&, double *);
+arma::vec NodeContribution (double *, unsigned int, unsigned int *, unsigned int, double *);
+void NodeContribution (double *, unsigned int, unsigned int *, unsigned int, double *, double *);
 double ModuleCoherence (double *, unsigned int);
+double SummaryAndContribution (double *, unsigned int, unsigned int *, unsigned int, double *, double *, SVDScratch&);
+bool LeadingSingularVector (const arma::mat&, double *, SVDScratch&);
+bool PowerIteration (SVDScratch&);
   
 #endif // __FUNCS__
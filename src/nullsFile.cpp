@@ -0,0 +1,282 @@
+#include "nullsFile.h"
+#include <cstring>
+#include <fstream>
+
+static const char NULLS_MAGIC[8] = { 'N', 'E', 'T', 'R', 'E', 'P', 'N', 'L' };
+static const uint32_t NULLS_VERSION = 2;
+
+// Round up to the next 64 byte boundary, so that each section of the file
+// starts on a cache line.
+static uint64_t Align (uint64_t offset) {
+  return (offset + 63) / 64 * 64;
+}
+
+/* Create a null distribution file and map it into memory
+ *
+ * Any existing file is overwritten. The observed statistics and null 
+ * distributions are not initialised: the caller must fill every element.
+ * No permutations are marked as complete.
+ *
+ * @param file path to the file to create.
+ * @param mods names of the modules (rows).
+ * @param stats names of the statistics (columns).
+ * @param nPerm number of permutations.
+ * @param seed seed of the permutation procedure's random number streams.
+ */
+NullsFile::NullsFile (
+  const std::string& file, const std::vector<std::string>& mods,
+  const std::vector<std::string>& stats, unsigned int nPerm, uint32_t seed
+) : modules(mods), statistics(stats) {
+  std::memcpy(header.magic, NULLS_MAGIC, sizeof(NULLS_MAGIC));
+  header.version = NULLS_VERSION;
+  header.nModules = modules.size();
+  header.nStats = statistics.size();
+  header.nPerm = nPerm;
+  header.seed = seed;
+  header.reserved = 0;
+
+  std::string names;
+  for (unsigned int ii = 0; ii < modules.size(); ++ii) {
+    names += modules[ii];
+    names.push_back('\0');
+  }
+  for (unsigned int ii = 0; ii < statistics.size(); ++ii) {
+    names += statistics[ii];
+    names.push_back('\0');
+  }
+
+  uint64_t sliceSize = (uint64_t)header.nModules * header.nStats * sizeof(double);
+  header.observedOffset = Align(sizeof(NullsFileHeader) + names.size());
+  header.doneOffset = Align(header.observedOffset + sliceSize);
+  header.dataOffset = Align(header.doneOffset + header.nPerm);
+  uint64_t fileSize = header.dataOffset + sliceSize * header.nPerm;
+
+  // Write the header and names, then extend the file to its full size so
+  // that it can be mapped. The extension reads as zeros, so no permutations
+  // are flagged as complete.
+  std::ofstream out (file.c_str(), std::ios::binary | std::ios::trunc);
+  out.write((const char *)&header, sizeof(NullsFileHeader));
+  out.write(names.data(), names.size());
+  out.seekp(fileSize - 1);
+  out.put('\0');
+  out.close();
+  if (out.fail()) {
+    throw Rcpp::exception(("could not create file " + file).c_str());
+  }
+
+  try {
+    mapping = boost::interprocess::file_mapping(
+      file.c_str(), boost::interprocess::read_write);
+    region = boost::interprocess::mapped_region(
+      mapping, boost::interprocess::read_write);
+  } catch (boost::interprocess::interprocess_exception& e) {
+    throw Rcpp::exception(("could not map file " + file + ": " + e.what()).c_str());
+  }
+}
+
+/* Open an existing null distribution file
+ *
+ * @param file path to a file created by the permutation procedure.
+ * @param writable if 'true', the file is mapped for writing so that an 
+ *   interrupted permutation procedure can be resumed.
+ */
+NullsFile::NullsFile (const std::string& file, bool writable) {
+  boost::interprocess::mode_t mode = writable ? boost::interprocess::read_write
+                                              : boost::interprocess::read_only;
+  try {
+    mapping = boost::interprocess::file_mapping(file.c_str(), mode);
+    region = boost::interprocess::mapped_region(mapping, mode);
+  } catch (boost::interprocess::interprocess_exception& e) {
+    throw Rcpp::exception(("could not open file " + file + ": " + e.what()).c_str());
+  }
+
+  const char * begin = (const char *)region.get_address();
+  const std::string msg = file + " is not a null distribution file created by NetRep";
+  if (region.get_size() < sizeof(NullsFileHeader)) {
+    throw Rcpp::exception(msg.c_str());
+  }
+  std::memcpy(&header, begin, sizeof(NullsFileHeader));
+  uint64_t sliceSize = (uint64_t)header.nModules * header.nStats * sizeof(double);
+  if (std::memcmp(header.magic, NULLS_MAGIC, sizeof(NULLS_MAGIC)) != 0 ||
+      header.version != NULLS_VERSION || 
+      header.observedOffset < sizeof(NullsFileHeader) ||
+      header.doneOffset < header.observedOffset + sliceSize ||
+      header.dataOffset < header.doneOffset + header.nPerm ||
+      header.dataOffset > region.get_size() ||
+      region.get_size() - header.dataOffset < sliceSize * header.nPerm) {
+    throw Rcpp::exception(msg.c_str());
+  }
+
+  // Read in the module and statistic names
+  const char * name = begin + sizeof(NullsFileHeader);
+  const char * end = begin + header.observedOffset;
+  for (unsigned int ii = 0; ii < header.nModules + header.nStats; ++ii) {
+    const char * nameEnd = (const char *)std::memchr(name, '\0', end - name);
+    if (nameEnd == NULL) {
+      throw Rcpp::exception(msg.c_str());
+    }
+    if (ii < header.nModules) {
+      modules.push_back(std::string(name, nameEnd));
+    } else {
+      statistics.push_back(std::string(name, nameEnd));
+    }
+    name = nameEnd + 1;
+  }
+}
+
+/* Memory address of the null distributions
+ *
+ * Must not be written to if the file was opened for reading.
+ */
+double * NullsFile::Data () {
+  return (double *)((char *)region.get_address() + header.dataOffset);
+}
+
+/* Memory address of the observed statistics
+ */
+double * NullsFile::Observed () {
+  return (double *)((char *)region.get_address() + header.observedOffset);
+}
+
+/* Memory address of the completed permutation flags
+ * 
+ * Only updated by 'Checkpoint'.
+ */
+unsigned char * NullsFile::Done () {
+  return (unsigned char *)region.get_address() + header.doneOffset;
+}
+
+/* Number of permutations flagged as complete
+ */
+unsigned int NullsFile::NumCompleted () {
+  unsigned char * done = Done();
+  unsigned int nCompleted = 0;
+  for (unsigned int ii = 0; ii < header.nPerm; ++ii) {
+    nCompleted += done[ii] != 0;
+  }
+  return nCompleted;
+}
+
+/* Check whether the file was created by the same analysis
+ * 
+ * Used before resuming an interrupted permutation procedure. The observed
+ * statistics are compared too, so that a file is not resumed with different
+ * input data. They are recalculated from scratch, so they only need to match
+ * to within numerical precision.
+ * 
+ * @param mods names of the modules (rows).
+ * @param stats names of the statistics (columns).
+ * @param nPerm number of permutations.
+ * @param seed seed of the permutation procedure's random number streams.
+ * @param obsAddr memory address of the observed statistics.
+ * 
+ * @return 'true' if the file can be resumed by this analysis.
+ */
+bool NullsFile::Matches (
+  const std::vector<std::string>& mods, const std::vector<std::string>& stats,
+  unsigned int nPerm, uint32_t seed, double * obsAddr
+) {
+  if (mods != modules || stats != statistics || nPerm != header.nPerm ||
+      seed != header.seed) {
+    return false;
+  }
+  double * saved = Observed();
+  for (unsigned int ii = 0; ii < header.nModules * header.nStats; ++ii) {
+    if (arma::is_finite(saved[ii]) != arma::is_finite(obsAddr[ii])) {
+      return false;
+    }
+    if (arma::is_finite(saved[ii]) && std::abs(saved[ii] - obsAddr[ii]) >
+          1e-8 * std::max(1.0, std::abs(saved[ii]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Save the permutation procedure's progress to disk
+ * 
+ * The null distributions are flushed to disk before the flags marking them 
+ * as complete, so that a permutation is never flagged in the file without
+ * its statistics, even if the machine goes down part way through. May be 
+ * called while the permutation workers are running.
+ * 
+ * @param done flags set by the permutation workers once each permutation's
+ *   statistics have been written.
+ */
+void NullsFile::Checkpoint (std::atomic<unsigned char> * done) {
+  std::vector<unsigned char> completed (header.nPerm);
+  for (unsigned int ii = 0; ii < header.nPerm; ++ii) {
+    completed[ii] = done[ii].load(std::memory_order_acquire);
+  }
+  region.flush(0, 0, false);
+  if (header.nPerm > 0) {
+    std::memcpy(Done(), &completed[0], header.nPerm);
+  }
+  region.flush(header.doneOffset, header.nPerm, false);
+}
+
+///' Read the dimensions of a null distribution file
+///'
+///' @param file path to a file of null distributions written by
+///'   'PermutationProcedure'.
+///'
+///' @return a list containing the module names, statistic names, number of
+///'   permutations, and number of completed permutations stored in the file,
+///'   and the seed used to generate them.
+///'
+///' @keywords internal
+// [[Rcpp::export]]
+Rcpp::List NullsFileInfo (Rcpp::CharacterVector file) {
+  NullsFile nulls (Rcpp::as<std::string>(file[0]));
+  return Rcpp::List::create(
+    Rcpp::Named("modules") = Rcpp::CharacterVector(nulls.modules.begin(), nulls.modules.end()),
+    Rcpp::Named("statistics") = Rcpp::CharacterVector(nulls.statistics.begin(), nulls.statistics.end()),
+    Rcpp::Named("nPerm") = nulls.header.nPerm,
+    Rcpp::Named("nCompleted") = nulls.NumCompleted(),
+    Rcpp::Named("seed") = (int)nulls.header.seed
+  );
+}
+
+///' Read a chunk of permutations from a null distribution file
+///'
+///' Only the requested permutations are read from disk.
+///'
+///' @param file path to a file of null distributions written by
+///'   'PermutationProcedure'.
+///' @param first the first permutation to read.
+///' @param count the number of permutations to read.
+///'
+///' @return an array of null distribution observations, with the same
+///'   dimensions and dimension names as the 'nulls' returned by
+///'   'PermutationProcedure'.
+///'
+///' @keywords internal
+// [[Rcpp::export]]
+Rcpp::NumericVector ReadNullsFile (
+  Rcpp::CharacterVector file, Rcpp::IntegerVector first,
+  Rcpp::IntegerVector count
+) {
+  NullsFile nulls (Rcpp::as<std::string>(file[0]));
+  if (first[0] < 1 || count[0] < 0 ||
+      (uint64_t)first[0] - 1 + count[0] > nulls.header.nPerm) {
+    throw Rcpp::exception("requested permutations are not in the file");
+  }
+  unsigned int from = first[0] - 1;
+  unsigned int nPerm = count[0];
+
+  std::size_t sliceSize = (std::size_t)nulls.header.nModules * nulls.header.nStats;
+  double * begin = nulls.Data() + from * sliceSize;
+  Rcpp::NumericVector chunk (begin, begin + nPerm * sliceSize);
+
+  std::vector<std::string> permNames(nPerm);
+  for (unsigned int ii = 0; ii < permNames.size(); ++ii) {
+    permNames[ii] = "permutation." + std::to_string(from + ii + 1);
+  }
+  chunk.attr("dim") = Rcpp::IntegerVector::create(
+    nulls.header.nModules, nulls.header.nStats, nPerm);
+  chunk.attr("dimnames") = Rcpp::List::create(
+    Rcpp::CharacterVector(nulls.modules.begin(), nulls.modules.end()),
+    Rcpp::CharacterVector(nulls.statistics.begin(), nulls.statistics.end()),
+    permNames);
+  return chunk;
+}
@@ -0,0 +1,70 @@
+#ifndef __NULLSFILE__
+#define __NULLSFILE__
+
+#define ARMA_USE_LAPACK
+#define ARMA_USE_BLAS
+#define ARMA_NO_DEBUG
+#define ARMA_DONT_PRINT_ERRORS
+//#define ARMA_DONT_USE_CXX11
+#define BOOST_DISABLE_ASSERTS
+
+#include <RcppArmadillo.h>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Fixed size header at the start of a null distribution file
+ *
+ * The header is followed by the module names and statistic names, each
+ * terminated by a '\0', the observed statistics, a flag for each 
+ * permutation marking whether it has been completed, and the null 
+ * distributions. Each section starts on a 64 byte boundary.
+ */
+struct NullsFileHeader {
+  char magic[8]; // "NETREPNL"
+  uint32_t version;
+  uint32_t nModules;
+  uint32_t nStats;
+  uint32_t nPerm;
+  uint32_t seed; // seed of the permutation procedure's random number streams
+  uint32_t reserved;
+  uint64_t observedOffset; // start of the observed statistics
+  uint64_t doneOffset; // start of the completed permutation flags
+  uint64_t dataOffset; // start of the null distributions
+};
+
+/* Null distributions stored in a memory-mapped file
+ *
+ * The null distributions are stored as a column-major array of doubles with
+ * dimensions 'nModules' x 'nStats' x 'nPerm', i.e. the same layout as the
+ * 'nulls' cube in the permutation procedure, so that the permutation
+ * workers can write each permutation's statistics directly into the file.
+ * Because each permutation draws from its own random number stream, the 
+ * completed permutation flags are all that is needed to resume an 
+ * interrupted permutation procedure, see 'Checkpoint'. The file is unmapped
+ * when the object is destroyed.
+ */
+class NullsFile {
+public:
+  NullsFile (const std::string&, const std::vector<std::string>&,
+             const std::vector<std::string>&, unsigned int, uint32_t);
+  NullsFile (const std::string&, bool = false);
+  double * Data ();
+  double * Observed ();
+  unsigned char * Done ();
+  unsigned int NumCompleted ();
+  bool Matches (const std::vector<std::string>&, const std::vector<std::string>&,
+                unsigned int, uint32_t, double *);
+  void Checkpoint (std::atomic<unsigned char> *);
+  NullsFileHeader header;
+  std::vector<std::string> modules;
+  std::vector<std::string> statistics;
+private:
+  boost::interprocess::file_mapping mapping;
+  boost::interprocess::mapped_region region;
+};
+
+#endif // __NULLSFILE__
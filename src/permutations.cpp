@@ -1,106 +1,425 @@
 #include "utils.h"
 #include "netStats.h"
 #include "thread-utils.h"
+#include "rng.h"
+#include "nullsFile.h"
+#include "largeModules.h"
+#include "blas-threads.h"
+#include "sequential.h"
+#include <algorithm>
+#include <functional>
+#include <fstream>
+#include <map>
+#include <memory>
+
+// The module preservation statistics, in the order of the columns of the 
+// results when all of them are requested.
+enum Statistic {
+  AVG_WEIGHT, COHERENCE, COR_COR, COR_DEGREE, COR_CONTRIB, AVG_COR, 
+  AVG_CONTRIB, N_STATISTICS
+};
+static const std::vector<std::string> STATISTIC_NAMES = {
+  "avg.weight", "coherence", "cor.cor", "cor.degree", "cor.contrib", 
+  "avg.cor", "avg.contrib"
+};
+
+// Number of permutations whose weighted degree and node contributions are 
+// correlated with the discovery dataset together, see 'BlockCorrelation'.
+#define PERM_BLOCK 16
+
+// Components of the calculation that the statistics depend on
+#define NEEDS_DEGREE 1 // weighted degree: "avg.weight" and "cor.degree"
+#define NEEDS_CORR 2 // correlation structure: "cor.cor" and "avg.cor"
+#define NEEDS_DATA 4 // summary profile: "coherence", "cor.contrib", "avg.contrib"
+
+/* Which components are needed to calculate a set of statistics?
+ * 
+ * @param statIdx the statistics to calculate, see 'Statistic'.
+ * 
+ * @return a bitmask of 'NEEDS_DEGREE', 'NEEDS_CORR', and 'NEEDS_DATA'.
+ */
+static unsigned int Components (const std::vector<unsigned int>& statIdx) {
+  unsigned int components = 0;
+  for (unsigned int ii = 0; ii < statIdx.size(); ++ii) {
+    switch (statIdx[ii]) {
+    case AVG_WEIGHT: case COR_DEGREE: 
+      components |= NEEDS_DEGREE; 
+      break;
+    case COR_COR: case AVG_COR: 
+      components |= NEEDS_CORR; 
+      break;
+    default: 
+      components |= NEEDS_DATA;
+    }
+  }
+  return components;
+}
 
 /* Generate null-distribution observations for the module preservation statistics
  * 
- * Fills out the corresponding slices of the provided 'nulls' cube based on the
- * number of permutations requested, and the start index.
+ * Fills out slices of the provided 'nulls' cube, claiming batches of
+ * permutations from a shared cursor until all permutations are complete.
+ * If 'nullsAddr' is NULL, the null distributions are not kept: instead each
+ * permutation's statistics are tallied against the observed statistics.
+ * 
+ * Compiled separately for each combination of 'COMPONENTS' (see 
+ * 'Components'), so that the work for statistics that were not requested
+ * is left out of the inner loop entirely, rather than skipped at run time.
  * 
- * @param tDataAddr memory address of the (scaled) test data matrix.
+ * Each batch is worked through in blocks of up to 'PERM_BLOCK' permutations.
+ * The test weighted degree and node contributions for the whole block are
+ * kept, and their correlations with the discovery dataset are calculated 
+ * with one matrix product per module once the block is complete, rather 
+ * than one pass per permutation.
+ * 
+ * @param tDataAddr memory address of the (scaled) test data matrix, or NULL
+ *   if 'COMPONENTS' does not include 'NEEDS_DATA'.
  * @param tCorrAddr memory address of the test correlation matrix.
  * @param tNetAddr memory address of the test network matrix.
  * @param nSamples number of samples in the test dataset.
  * @param nNodes number of nodes in the test network.
- * @param addrWD unordered_map containing the memory addresses of the weighted 
- *   degree vectors for all modules in the discovery dataset.
- * @param addrNC unordered_map containing the memory addresses of the node 
- *   contribution vectors for all modules in the discovery dataset.
- * @param addrCV unordered_map containing the memory addresses of the 
- *   correlation coefficient vectors for all modules in the discovery dataset.
- * @param mods vector of modules for which the module preservation statistics
- *   are being calculated for.
- * @param modNodeMap mapping of module labels to node IDs.
- * @param modIdxMap mapping of module labels to 'nulls' cube row indices.
- * @param nullIdx a vector of node IDs to be shuffled in the permutation 
+ * @param plan integer-indexed layout of the modules to analyse, see 
+ *   'MakeModulePlan'.
+ * @param nModules number of rows in the 'nulls' cube.
+ * @param statIdx the statistics in each column of the 'nulls' cube, see 
+ *   'Statistic'.
+ * @param shareGroup if not empty, the group of modules of the same size that
+ *   each module shares its null distributions for "avg.weight" and 
+ *   "coherence" with. At each permutation, these are only calculated for 
+ *   the first module in each group, skipping the weighted degree and 
+ *   summary profile of the others where no other statistic needs them.
+ * @param nullIdx a vector of node IDs to be sampled from in the permutation 
  *  procedure.
- * @param nullMap mapping of node IDs to indices in 'nullIdx'.
- * @param nullsAddr memory address of the cube to store the results in
+ * @param seed seed for the random number streams. Permutation 'k' always
+ *  draws from stream 'k', see 'PermutationRNG'.
+ * @param nullsAddr memory address of the cube to store the results in, or
+ *  NULL if only the tallies are needed.
+ * @param obsAddr memory address of the matrix of observed statistics.
+ * @param talliesAddr memory address of this thread's tallies, see 
+ *  'TallyNulls'. Only used if 'nullsAddr' is NULL.
+ * @param tailsAddr memory address of this thread's tails of the null 
+ *  distributions, see 'TallyTails', or NULL if they are not needed. Only 
+ *  used if 'nullsAddr' is NULL.
+ * @param naValue R's NA_REAL, which non-finite statistics are stored as. 
+ *   Passed in because the threads cannot use R's API.
+ * @param doneAddr flags marking each completed permutation, or NULL if the
+ *   null distributions are not being checkpointed (see 'NullsFile'). 
+ *   Permutations that are already flagged are skipped.
  * @param totalPerm total number of permutations.
- * @param nPerm number of permutations for this thread to calculate.
- * @param start slice index to start at when filling in the 'nulls' cube.
- * @param progressAddr memory address of the vector to fill in number of 
- *  permutations completed for this thread.
- * @param nThreads total number of threads executing.
- * @param thread the number of the thread.
- * @param interrupted variable on the heap checking whether the user has asked
- *   to cancel the computation
+ * @param cursor shared counter of the next permutation to be claimed by a 
+ *  thread, see 'ClaimBatch'.
+ * @param batchSize number of permutations to claim from 'cursor' at a time.
+ * @param progress progress shared with 'MonitorProgress'. Each completed
+ *  permutation is counted, and the thread stops if it has been interrupted.
+ * @param sequential if not NULL, permutations are claimed from here instead 
+ *  of 'cursor', and modules it has stopped are skipped, leaving their 
+ *  statistics missing (see 'SequentialStopping').
  */
+template <unsigned int COMPONENTS>
 void calculateNulls(
   double * tDataAddr, double * tCorrAddr, double * tNetAddr, 
-  unsigned int nSamples, unsigned int nNodes, addrmap& addrWD, addrmap& addrNC, 
-  addrmap& addrCV, const std::vector<std::string> mods, 
-  const stringmap modNodeMap, const namemap modIdxMap, arma::uvec nullIdx,
-  namemap nullMap, double * nullsAddr, unsigned int totalPerm, 
-  unsigned int nPerm, unsigned int start, unsigned int * progressAddr,
-  unsigned int nThreads, unsigned int thread, bool& interrupted
+  unsigned int nSamples, unsigned int nNodes, const ModulePlan& plan, 
+  unsigned int nModules, const std::vector<unsigned int>& statIdx, 
+  const std::vector<int>& shareGroup, arma::uvec nullIdx, uint64_t seed, 
+  double * nullsAddr, double * obsAddr, unsigned int * talliesAddr, 
+  double * tailsAddr, 
+  double naValue, std::atomic<unsigned char> * doneAddr, unsigned int totalPerm,
+  std::atomic<unsigned int>& cursor, 
+  unsigned int batchSize, Progress& progress, SequentialStopping * sequential
 ) {    
   /**
    * Note: the R API is single threaded, we *must not* access it
    * at all in this function or any functions it calls (i.e. netStats.cpp).
    **/
   
-  // Tell this thread where the results cube and progress bar are located in 
-  // memory:
-  arma::cube nulls = arma::cube(nullsAddr, mods.size(), 7, totalPerm, false, true);
-  arma::uvec progress = arma::uvec(progressAddr, nThreads, false, true);
+  // Each permutation's statistics are written straight into its slice of the
+  // 'nulls' cube, or if the nulls are not being kept, to a buffer that is 
+  // tallied against the observed statistics.
+  const unsigned int nStats = statIdx.size();
+  arma::cube buffer;
+  if (nullsAddr == NULL) {
+    buffer.set_size(nModules, nStats, PERM_BLOCK);
+    buffer.fill(arma::datum::nan);
+  }
+  auto statsAddr = [&](unsigned int pp) {
+    if (nullsAddr != NULL) {
+      return nullsAddr + (std::size_t)pp * nModules * nStats;
+    }
+    return buffer.slice(pp % PERM_BLOCK).memptr();
+  };
+  double values[N_STATISTICS]; // all statistics for the current module
+  std::fill(values, values + N_STATISTICS, arma::datum::nan);
+  int statCol[N_STATISTICS]; // column of each statistic, or -1 if not requested
+  std::fill(statCol, statCol + N_STATISTICS, -1);
+  for (unsigned int si = 0; si < nStats; ++si) {
+    statCol[statIdx[si]] = si;
+  }
+  
+  // The "avg.weight" and "coherence" shared by each group of modules at the
+  // current permutation, and the permutation each group's were calculated 
+  // at. Only the first active module of a group in each permutation 
+  // calculates them.
+  int nGroups = 0;
+  for (unsigned int mi = 0; mi < shareGroup.size(); ++mi) {
+    nGroups = std::max(nGroups, shareGroup[mi] + 1);
+  }
+  arma::mat groupValues (nGroups, 2);
+  std::vector<unsigned int> groupPerm (nGroups, totalPerm);
+  // Are the weighted degree and summary profile only needed for the shared
+  // statistics?
+  const bool degreeShared = statCol[COR_DEGREE] < 0;
+  const bool dataShared = statCol[COR_CONTRIB] < 0 && statCol[AVG_CONTRIB] < 0;
+  int group;
+  bool reuse, needDegree, needData;
   
-  std::string mod;
   unsigned int modIdx, mNodes;
-  arma::uvec tIdx, tRank;
-  arma::vec tWD, tSP, tNC, tCV;
-  for (unsigned int pp = start; pp < start + nPerm; ++pp) {
-    nullIdx = arma::shuffle(nullIdx);
-    for (auto mi = mods.begin(); mi != mods.end(); ++mi) {
-      if (interrupted) return; 
-      // What module are we analysing, and what index does it have internally?
-      mod = *mi; 
-      modIdx = modIdxMap.at(mod);
-     
-      // Get the node indices in the test dataset for this module
-      tIdx = GetRandomIdx(mod, modNodeMap, nullIdx.memptr(), nullIdx.n_elem, nullMap);
-      mNodes = tIdx.n_elem;
-      
-      // Now calculate required properties in the test dataset
-      tCV = CorrVector(tCorrAddr, nNodes, tIdx.memptr(), mNodes);
-      if (interrupted) return; 
-      
-      // Sort nodes indices for sequential memory access
-      tRank = SortNodes(tIdx.memptr(), mNodes); 
+  // Only the nodes in the modules need to be drawn at each permutation: 
+  // 'pool' is restored to its original order after each draw so that every
+  // permutation starts from the same state.
+  arma::uvec pool = nullIdx;
+  arma::uvec swaps (plan.nSlots);
+  // All scratch memory is allocated up front, sized for the largest module
+  Workspace ws (plan.maxNodes, nSamples);
+  double * tWD = ws.wd.memptr();
+  double * tNC = ws.nc.memptr();
+  double corCor, avgCor;
+  
+  // The weighted degree and node contribution of each module are collected
+  // for a block of permutations, so that their correlations with the 
+  // discovery dataset can be calculated together (see 'BlockCorrelation').
+  // Module 'mi' has an 'mNodes' by 'PERM_BLOCK' matrix starting at 
+  // 'blockOffsets[mi]', with a column for each permutation in the block.
+  std::vector<std::size_t> blockOffsets (plan.rows.size() + 1, 0);
+  for (unsigned int mi = 0; mi < plan.rows.size(); ++mi) {
+    blockOffsets[mi + 1] = blockOffsets[mi] + 
+      (std::size_t)(plan.offsets[mi + 1] - plan.offsets[mi]) * PERM_BLOCK;
+  }
+  arma::vec blockWD, blockNC;
+  if (COMPONENTS & NEEDS_DEGREE) {
+    blockWD.zeros(blockOffsets.back());
+  }
+  if (COMPONENTS & NEEDS_DATA) {
+    blockNC.zeros(blockOffsets.back());
+  }
+  arma::vec blockCor (PERM_BLOCK), blockMean (PERM_BLOCK);
+  arma::vec scratch (2 * (plan.maxNodes + PERM_BLOCK));
+  bool pending[PERM_BLOCK]; // permutations in the block being calculated
+  unsigned int col, first, last;
+  
+  // Keep claiming batches of permutations until there are none left
+  unsigned int start, end;
+  while (sequential != NULL ? sequential->ClaimBatch(batchSize, start, end) :
+         ClaimBatch(cursor, batchSize, totalPerm, start, end)) {
+    // Work through the batch a block at a time. Blocks are aligned to 
+    // multiples of 'PERM_BLOCK', so each permutation always has the same 
+    // column in the block matrices, however the permutations are split into
+    // batches.
+    for (unsigned int bStart = start, bEnd; bStart < end; bStart = bEnd) {
+      bEnd = std::min(end, (bStart / PERM_BLOCK + 1) * PERM_BLOCK);
+      first = bStart % PERM_BLOCK;
+      last = first + (bEnd - bStart);
       
-      tWD = WeightedDegree(tNetAddr, nNodes, tIdx.memptr(), mNodes);
-      tWD = tWD(tRank); //reorder results
-      if (interrupted) return; 
+      // First calculate everything except the block correlations
+      for (unsigned int pp = bStart; pp < bEnd; ++pp) {
+        col = pp % PERM_BLOCK;
+        // Skip permutations completed before the procedure was resumed
+        pending[col] = doneAddr == NULL || 
+          !doneAddr[pp].load(std::memory_order_relaxed);
+        if (!pending[col]) {
+          continue;
+        }
+        // Randomly assign nodes using this permutation's own random number
+        // stream, so that the result does not depend on which thread 
+        // computes it.
+        PermutationRNG rng (seed, pp);
+        PartialShuffle(pool.memptr(), pool.n_elem, plan.nSlots, rng, 
+                       swaps.memptr());
+        arma::mat stats = arma::mat(statsAddr(pp), nModules, nStats, false, true);
+        for (unsigned int mi = 0; mi < plan.rows.size(); ++mi) {
+          if (progress.Interrupted()) return; 
+          // Which row of the results does this module have?
+          modIdx = plan.rows[mi];
+          
+          // Skip modules whose p-values have already been decided
+          if (sequential != NULL && !sequential->Active(modIdx)) {
+            stats.row(modIdx).fill(naValue);
+            continue;
+          }
+       
+          // Has another module of the same size already calculated the 
+          // shared statistics at this permutation?
+          group = shareGroup.empty() ? -1 : shareGroup[mi];
+          reuse = group >= 0 && groupPerm[group] == pp;
+          needDegree = (COMPONENTS & NEEDS_DEGREE) && !(reuse && degreeShared);
+          needData = (COMPONENTS & NEEDS_DATA) && !(reuse && dataShared);
+       
+          // Get the node indices in the test dataset for this module
+          mNodes = GetRandomIdx(plan, mi, pool.memptr(), ws.idx.memptr());
+          if (COMPONENTS & NEEDS_DEGREE) {
+            tWD = blockWD.memptr() + blockOffsets[mi] + col * mNodes;
+          }
+          if (COMPONENTS & NEEDS_DATA) {
+            tNC = blockNC.memptr() + blockOffsets[mi] + col * mNodes;
+          }
+        
+          // Sort nodes indices for sequential memory access
+          SortNodes(ws.idx.memptr(), mNodes, ws.rank.memptr(), ws.order.memptr()); 
+        
+          // Now calculate required properties in the test dataset. The 
+          // correlation structure statistics are accumulated directly against
+          // the discovery correlation vector, and the weighted degree comes 
+          // out in the original node order.
+          if ((COMPONENTS & NEEDS_CORR) && needDegree) {
+            CorrAndDegree<true, true>(
+              tCorrAddr, tNetAddr, nNodes, ws.idx.memptr(), ws.order.memptr(), 
+              mNodes, plan.corrMoments[mi], plan.corr[mi], tWD, 
+              ws.start.data(), corCor, avgCor);
+          } else if (COMPONENTS & NEEDS_CORR) {
+            CorrAndDegree<true, false>(
+              tCorrAddr, tNetAddr, nNodes, ws.idx.memptr(), ws.order.memptr(), 
+              mNodes, plan.corrMoments[mi], plan.corr[mi], tWD, 
+              ws.start.data(), corCor, avgCor);
+          } else if (needDegree) {
+            CorrAndDegree<false, true>(
+              tCorrAddr, tNetAddr, nNodes, ws.idx.memptr(), ws.order.memptr(), 
+              mNodes, plan.corrMoments[mi], plan.corr[mi], tWD, 
+              ws.start.data(), corCor, avgCor);
+          }
+          if (progress.Interrupted()) return; 
+          if (needDegree) {
+            values[AVG_WEIGHT] = AverageEdgeWeight(tWD, mNodes);
+          }
+          if (COMPONENTS & NEEDS_CORR) {
+            values[COR_COR] = corCor;
+            values[AVG_COR] = avgCor;
+          }
+          if (needData) {
+            values[COHERENCE] = SummaryAndContribution(tDataAddr, nSamples, 
+                                                       ws.idx.memptr(), mNodes,
+                                                       ws.sp.memptr(), tNC, 
+                                                       ws.svd);
+            Reorder(tNC, ws.rank.memptr(), mNodes, ws.tmp.memptr());
+            if (progress.Interrupted()) return; 
+          }
+          if (reuse) {
+            values[AVG_WEIGHT] = groupValues.at(group, 0);
+            values[COHERENCE] = groupValues.at(group, 1);
+          } else if (group >= 0) {
+            groupValues.at(group, 0) = values[AVG_WEIGHT];
+            groupValues.at(group, 1) = values[COHERENCE];
+            groupPerm[group] = pp;
+          }
+        
+          // Store the requested statistics in the appropriate location in the 
+          // results matrix. The correlations with the discovery weighted 
+          // degree and node contribution are filled in once the block is 
+          // complete.
+          for (unsigned int si = 0; si < nStats; ++si) {
+            stats.at(modIdx, si) = values[statIdx[si]];
+          }
+        }
+        UndoShuffle(pool.memptr(), plan.nSlots, swaps.memptr());
+      }
       
-      tSP = SummaryProfile(tDataAddr, nSamples, nNodes, tIdx.memptr(), mNodes);
-      if (interrupted) return; 
+      // Then calculate the correlations for every permutation in the block
+      for (unsigned int mi = 0; mi < plan.rows.size(); ++mi) {
+        if (progress.Interrupted()) return; 
+        modIdx = plan.rows[mi];
+        if (sequential != NULL && !sequential->Active(modIdx)) {
+          continue;
+        }
+        mNodes = plan.offsets[mi + 1] - plan.offsets[mi];
+        if ((COMPONENTS & NEEDS_DEGREE) && statCol[COR_DEGREE] >= 0) {
+          BlockCorrelation(plan.degreeMoments[mi], plan.degree[mi], 
+                           blockWD.memptr() + blockOffsets[mi], mNodes, 
+                           PERM_BLOCK, first, last, blockCor.memptr(), NULL, 
+                           scratch.memptr());
+          for (unsigned int pp = bStart; pp < bEnd; ++pp) {
+            if (pending[pp % PERM_BLOCK]) {
+              statsAddr(pp)[statCol[COR_DEGREE] * nModules + modIdx] = 
+                blockCor[pp % PERM_BLOCK];
+            }
+          }
+        }
+        if ((COMPONENTS & NEEDS_DATA) && 
+            (statCol[COR_CONTRIB] >= 0 || statCol[AVG_CONTRIB] >= 0)) {
+          BlockCorrelation(plan.contributionMoments[mi], plan.contribution[mi],
+                           blockNC.memptr() + blockOffsets[mi], mNodes, 
+                           PERM_BLOCK, first, last, blockCor.memptr(), 
+                           blockMean.memptr(), scratch.memptr());
+          for (unsigned int pp = bStart; pp < bEnd; ++pp) {
+            if (!pending[pp % PERM_BLOCK]) {
+              continue;
+            }
+            if (statCol[COR_CONTRIB] >= 0) {
+              statsAddr(pp)[statCol[COR_CONTRIB] * nModules + modIdx] = 
+                blockCor[pp % PERM_BLOCK];
+            }
+            if (statCol[AVG_CONTRIB] >= 0) {
+              statsAddr(pp)[statCol[AVG_CONTRIB] * nModules + modIdx] = 
+                blockMean[pp % PERM_BLOCK];
+            }
+          }
+        }
+      }
       
-      tNC = NodeContribution(tDataAddr, nSamples, nNodes, tIdx.memptr(),
-                             mNodes, tSP.memptr());
-      tNC = tNC(tRank); // reorder results
-      if (interrupted) return; 
-      
-      // Calculate and store test statistics in the appropriate location in the 
-      // results matrix
-      nulls.at(modIdx, 0, pp) = AverageEdgeWeight(tWD.memptr(), tWD.n_elem);
-      nulls.at(modIdx, 1, pp) = ModuleCoherence(tNC.memptr(), tNC.n_elem);
-      nulls.at(modIdx, 2, pp) = Correlation(addrCV[mod], tCV.memptr(), tCV.n_elem);
-      nulls.at(modIdx, 3, pp) = Correlation(addrWD[mod], tWD.memptr(), tWD.n_elem);
-      nulls.at(modIdx, 4, pp) = Correlation(addrNC[mod], tNC.memptr(), tNC.n_elem);
-      nulls.at(modIdx, 5, pp) = SignAwareMean(addrCV[mod], tCV.memptr(), tCV.n_elem);
-      nulls.at(modIdx, 6, pp) = SignAwareMean(addrNC[mod], tNC.memptr(), tNC.n_elem);
+      // Finally, record each permutation in the block as complete
+      for (unsigned int pp = bStart; pp < bEnd; ++pp) {
+        if (!pending[pp % PERM_BLOCK]) {
+          continue;
+        }
+        // Store any missing statistics the way R expects them, so that the 
+        // null distributions need no further processing once returned.
+        double * ppStats = statsAddr(pp);
+        for (unsigned int ii = 0; ii < nModules * nStats; ++ii) {
+          if (!arma::is_finite(ppStats[ii])) {
+            ppStats[ii] = naValue;
+          }
+        }
+        if (nullsAddr == NULL) {
+          if (tailsAddr != NULL) {
+            TallyTails(ppStats, nModules * nStats, 
+                       talliesAddr + 2 * nModules * nStats, tailsAddr);
+          }
+          TallyNulls(ppStats, obsAddr, nModules, nStats, talliesAddr);
+        }
+        if (doneAddr != NULL) {
+          doneAddr[pp].store(1, std::memory_order_release);
+        }
+        if (sequential != NULL) {
+          sequential->Finished();
+        }
+        progress.Increment();
+      }
     }
-    progress[thread]++; 
+  }
+}
+
+// The permutation kernel compiled for one combination of components
+typedef decltype(&calculateNulls<0>) NullsKernel;
+
+/* Select the permutation kernel for a combination of components
+ * 
+ * @param components a bitmask of the components needed, see 'Components'.
+ * 
+ * @return the version of 'calculateNulls' compiled for 'components'.
+ */
+static NullsKernel SelectKernel (unsigned int components) {
+  switch (components) {
+  case NEEDS_DEGREE: 
+    return &calculateNulls<NEEDS_DEGREE>;
+  case NEEDS_CORR: 
+    return &calculateNulls<NEEDS_CORR>;
+  case NEEDS_DEGREE | NEEDS_CORR: 
+    return &calculateNulls<NEEDS_DEGREE | NEEDS_CORR>;
+  case NEEDS_DATA: 
+    return &calculateNulls<NEEDS_DATA>;
+  case NEEDS_DEGREE | NEEDS_DATA: 
+    return &calculateNulls<NEEDS_DEGREE | NEEDS_DATA>;
+  case NEEDS_CORR | NEEDS_DATA: 
+    return &calculateNulls<NEEDS_CORR | NEEDS_DATA>;
+  default: 
+    return &calculateNulls<NEEDS_DEGREE | NEEDS_CORR | NEEDS_DATA>;
   }
 }
 
@@ -117,6 +436,8 @@ void calculateNulls(
 ///'         consistent.}
 ///'   \item{The columns of 'tData' are the nodes.}
 ///'   \item{'tData' has been scaled by 'Scale'.}
+///'   \item{'statistics' contains only names of module preservation
+///'         statistics, without duplicates.}
 ///'   \item{'tCorr' and 'tNet' are square matrices, and their rownames are 
 ///'         identical to their column names.}
 ///'   \item{'moduleAssigments' is a named character vector, where the names
@@ -134,8 +455,11 @@ void calculateNulls(
 ///' }
 ///' 
 ///' @param discProps a list of intermediate properties calculated in the 
-///'   discovery dataset by \code{\link{IntermediateProperties}}.
-///' @param tData scaled data matrix from the \emph{test} dataset.
+///'   discovery dataset by \code{\link{IntermediateProperties}}, or by
+///'   \code{\link{IntermediatePropertiesNoData}} if none of the 'statistics'
+///'   depend on the data matrices.
+///' @param tData scaled data matrix from the \emph{test} dataset. May be an 
+///'   empty matrix if none of the 'statistics' depend on the data matrices.
 ///' @param tCorr matrix of correlation coefficients between all pairs of 
 ///'   variables/nodes in the \emph{test} dataset.
 ///' @param tNet adjacency matrix of network edge weights between all pairs of 
@@ -144,37 +468,96 @@ void calculateNulls(
 ///'   each node belongs to in the discovery dataset. 
 ///' @param modules a character vector of modules for which to calculate the 
 ///'   module preservation statistics.
+///' @param statistics a character vector of the module preservation 
+///'   statistics to calculate. Only the work needed for these statistics is
+///'   done: in particular, the summary profile of each module is only 
+///'   calculated for "coherence", "cor.contrib", and "avg.contrib".
+///' @param shareNulls if 'true', modules with the same number of nodes in the
+///'   test dataset share their null distributions for "avg.weight" and 
+///'   "coherence", which only depend on the size of the random node sets.
 ///' @param nPermutations the number of permutations from which to generate the
 ///'   null distributions for each statistic.
 ///' @param nCores the number of cores that the permutation procedure may use.
 ///' @param nullHypothesis either "overlap" or "all".
+///' @param seed seed for the permutation procedure's random number 
+///'   streams. The same seed always generates the same null distributions,
+///'   regardless of 'nCores'.
+///' @param keepNulls if 'false', the null distributions are not stored. 
+///'   Instead, each thread tallies the permutations at least as extreme as 
+///'   the observed statistics (see 'TallyNulls'), so that memory no longer 
+///'   grows with 'nPermutations'.
+///' @param keepTails if 'true' and 'keepNulls' is 'false', the 'TAIL_SIZE'
+///'   largest and smallest values of each null distribution are kept (see 
+///'   'TallyTails'), so that p-values can be extrapolated from the tails.
+///' @param nullsFile optional path to a file. If provided, the null 
+///'   distributions are written directly into this file through a memory 
+///'   mapping instead of being kept in RAM (see 'NullsFile'). The file is 
+///'   checkpointed periodically, so that the procedure can be resumed if 
+///'   interrupted.
+///' @param resume if 'true' and 'nullsFile' already exists, the permutations
+///'   it records as complete are kept and only the rest are calculated.
+///' @param sequential significance threshold for stopping the permutations
+///'   of each module early once its p-values are confidently above or below
+///'   it (see 'SequentialStopping'), or 0 to run every permutation for every
+///'   module. Cannot be combined with 'resume'.
+///' @param alternative index of the alternative hypothesis in 
+///'   c("two.sided", "less", "greater"), used to decide when to stop.
+///' @param timeLimit number of seconds after which to stop the permutation
+///'   procedure, keeping the permutations completed so far, or 0 for no 
+///'   time limit.
+///' @param minPermutations number of permutations to complete before 
+///'   stopping at the time limit, regardless of the time taken.
 ///' @param verbose if 'true', then progress messages are printed.
 ///' @param vCat the vCat function must be passed in so that it can be called 
 ///'  for output logging. 
 ///' 
-///' @return a list containing a matrix of observed test statistics, and an
-///'   array of null distribution observations.
+///' @return a list containing a matrix of observed test statistics, and 
+///'   either an array of null distribution observations, the path to the
+///'   'nullsFile' they were written to, or, if 'keepNulls' is 'false', an 
+///'   array of permutation counts and, if 'keepTails' is 'true', an array 
+///'   of the tails of the null distributions. If 'sequential' is set, the 
+///'   list also contains the number of permutations run for each module. 
+///'   If the time limit was reached, the list also contains the indices of 
+///'   the completed permutations: all others are missing from the null 
+///'   distributions.
 ///'   
 ///' @keywords internal
 // [[Rcpp::export]]
 Rcpp::List PermutationProcedure (
   Rcpp::List discProps, Rcpp::NumericMatrix tData, Rcpp::NumericMatrix tCorr, 
   Rcpp::NumericMatrix tNet, Rcpp::CharacterVector moduleAssignments, 
-  Rcpp::CharacterVector modules, Rcpp::IntegerVector nPermutations, 
+  Rcpp::CharacterVector modules, Rcpp::CharacterVector statistics, 
+  Rcpp::LogicalVector shareNulls, Rcpp::IntegerVector nPermutations, 
   Rcpp::IntegerVector nCores, Rcpp::CharacterVector nullHypothesis, 
-  Rcpp::LogicalVector verbose, Rcpp::Function vCat
+  Rcpp::IntegerVector seed, Rcpp::LogicalVector keepNulls, 
+  Rcpp::LogicalVector keepTails, Rcpp::CharacterVector nullsFile, 
+  Rcpp::LogicalVector resume, Rcpp::NumericVector sequential, 
+  Rcpp::IntegerVector alternative, Rcpp::NumericVector timeLimit, 
+  Rcpp::IntegerVector minPermutations, Rcpp::LogicalVector verbose, 
+  Rcpp::Function vCat
 ) {
   // convert the colnames / rownames to C++ equivalents
   const std::vector<std::string> dNames (Rcpp::as<std::vector<std::string>>(moduleAssignments.names()));
   const std::vector<std::string> tNames (Rcpp::as<std::vector<std::string>>(colnames(tNet)));
   unsigned int nSamples = tData.nrow();
-  unsigned int nNodes = tData.ncol();
+  unsigned int nNodes = tNet.ncol();
   
-  // Define statistic names
-  const std::vector<std::string> statnames = {
-    "avg.weight", "coherence", "cor.cor", "cor.degree", "cor.contrib", 
-    "avg.cor", "avg.contrib"
-  };
+  // Look up which statistics to calculate, and what they depend on
+  const std::vector<std::string> statnames (Rcpp::as<std::vector<std::string>>(statistics));
+  std::vector<unsigned int> statIdx;
+  for (auto it = statnames.begin(); it != statnames.end(); ++it) {
+    auto found = std::find(STATISTIC_NAMES.begin(), STATISTIC_NAMES.end(), *it);
+    if (found == STATISTIC_NAMES.end()) {
+      throw Rcpp::exception(("unknown statistic " + *it).c_str());
+    }
+    statIdx.push_back(found - STATISTIC_NAMES.begin());
+  }
+  const unsigned int nStats = statIdx.size();
+  const unsigned int components = Components(statIdx);
+  const bool withData = (components & NEEDS_DATA) != 0;
+  if (withData && (unsigned int)tData.ncol() != nNodes) {
+    throw Rcpp::exception("the data matrix is needed to calculate the requested statistics");
+  }
   
   /* Next, we need to create three mappings:
    *  - From node IDs to indices in the test dataset.
@@ -203,12 +586,17 @@ Rcpp::List PermutationProcedure (
   // Typecast function options from R's vectors to appropriate C++ scalar 
   // equivalents
   std::string nullType = Rcpp::as<std::string>(nullHypothesis[0]);
+  uint64_t rngSeed = (uint32_t)seed[0];
   unsigned int nThreads = nCores[0];
   unsigned int nPerm = nPermutations[0];
   const bool verboseFlag = verbose[0];
   
-  // Initialise results container for storing observed test statistics
-  arma::mat obs (mods.size(), 7);
+  // Initialise results container for storing observed test statistics. It is
+  // allocated as an R matrix so that it can be returned without a copy.
+  Rcpp::NumericMatrix observed (mods.size(), nStats);
+  colnames(observed) = Rcpp::CharacterVector(statnames.begin(), statnames.end());
+  rownames(observed) = modules;
+  arma::mat obs = arma::mat(observed.begin(), mods.size(), nStats, false, true);
   obs.fill(NA_REAL);
 
   /* We need to convert each 'discProps' list to a mapping from each module
@@ -218,7 +606,10 @@ Rcpp::List PermutationProcedure (
   // We need to do a lot of casting to get list elements in C++!
   Rcpp::List lWD = Rcpp::as<Rcpp::List>(discProps["degree"]);
   Rcpp::List lCV = Rcpp::as<Rcpp::List>(discProps["corr"]);
-  Rcpp::List lNC = Rcpp::as<Rcpp::List>(discProps["contribution"]);
+  Rcpp::List lNC; // only calculated with the data matrices
+  if (withData) {
+    lNC = Rcpp::as<Rcpp::List>(discProps["contribution"]);
+  }
   Rcpp::NumericVector vWD, vCV, vNC; 
   
   addrmap addrWD, addrNC, addrCV; 
@@ -229,80 +620,166 @@ Rcpp::List PermutationProcedure (
     // Extract the numeric vectors
     vWD = Rcpp::as<Rcpp::NumericVector>(lWD[mod]);
     vCV = Rcpp::as<Rcpp::NumericVector>(lCV[mod]);
-    vNC = Rcpp::as<Rcpp::NumericVector>(lNC[mod]);
     
     addrWD[mod] = vWD.begin();
     addrCV[mod] = vCV.begin();
-    addrNC[mod] = vNC.begin();
+    if (withData) {
+      vNC = Rcpp::as<Rcpp::NumericVector>(lNC[mod]);
+      addrNC[mod] = vNC.begin();
+    }
   }
   
   R_CheckUserInterrupt();
   
   // Now calculate the observed test statistics
   vCat(verbose, 1, "Calculating observed test statistics...");
-  unsigned int modIdx, mNodes;
-  arma::uvec tIdx, tRank;
-  arma::vec tCV, tWD, tSP, tNC;
-  for (auto mi = modsPresent.begin(); mi != modsPresent.end(); ++mi) {
-    // What module are we analysing, and what index does it have internally?
-    mod = *mi;
-    modIdx = modIdxMap.at(mod);
-    
-    // Get the node indices in the test dataset for this module
-    tIdx = GetNodeIdx(mod, modNodePresentMap, tIdxMap);
-    mNodes = tIdx.n_elem;
+  if (withData && !BlasLibrary().empty()) {
+    vCat(verbose, 2, "BLAS threads (" + BlasLibrary() + "): 1 per module,", 
+         nThreads, "for large modules split across threads");
+  }
+  // Look up each module's nodes and discovery properties before going 
+  // parallel: the threads cannot use R's API.
+  std::vector<arma::uvec> tIdx (modsPresent.size());
+  std::vector<unsigned int> obsRows (modsPresent.size());
+  std::vector<double *> obsWD (modsPresent.size());
+  std::vector<double *> obsCV (modsPresent.size());
+  std::vector<double *> obsNC (modsPresent.size());
+  for (unsigned int mi = 0; mi < modsPresent.size(); ++mi) {
+    mod = modsPresent[mi];
+    tIdx[mi] = GetNodeIdx(mod, modNodePresentMap, tIdxMap);
+    obsRows[mi] = modIdxMap.at(mod);
+    obsWD[mi] = addrWD.at(mod);
+    obsCV[mi] = addrCV.at(mod);
+    obsNC[mi] = withData ? addrNC.at(mod) : NULL;
+  }
+  double * tDataAddr = withData ? tData.begin() : NULL;
+  double * tCorrAddr = tCorr.begin();
+  double * tNetAddr = tNet.begin();
+  
+  // Calculate the observed statistics for module 'mi', splitting the work 
+  // across 'nSplit' threads. Each module writes to its own row of the 
+  // observed statistics.
+  auto calculate = [&](unsigned int mi, unsigned int nSplit) {
+    unsigned int modIdx = obsRows[mi];
+    unsigned int mNodes = tIdx[mi].n_elem;
+    double values[N_STATISTICS]; // all statistics for this module
     
     // Now calculate required properties in the test dataset
-    tCV = CorrVector(tCorr.begin(), nNodes, tIdx.memptr(), mNodes);
-    R_CheckUserInterrupt();
+    if (components & NEEDS_CORR) {
+      arma::vec tCV = SplitCorrVector(nSplit, tCorrAddr, nNodes, 
+                                      tIdx[mi].memptr(), mNodes);
+      values[COR_COR] = Correlation(obsCV[mi], tCV.memptr(), tCV.n_elem);
+      values[AVG_COR] = SignAwareMean(obsCV[mi], tCV.memptr(), tCV.n_elem);
+    }
     
     // Sort node indices for sequential memory access
-    tRank = SortNodes(tIdx.memptr(), mNodes); 
-    
-    tWD = WeightedDegree(tNet.begin(), nNodes, tIdx.memptr(), mNodes);
-    tWD = tWD(tRank); // reorder results
-    R_CheckUserInterrupt(); 
+    arma::uvec tRank = SortNodes(tIdx[mi].memptr(), mNodes); 
     
-    tSP = SummaryProfile(tData.begin(), nSamples, nNodes, tIdx.memptr(), 
-                         mNodes);
-    R_CheckUserInterrupt(); 
+    if (components & NEEDS_DEGREE) {
+      arma::vec tWD = SplitWeightedDegree(nSplit, tNetAddr, nNodes, 
+                                          tIdx[mi].memptr(), mNodes);
+      tWD = tWD(tRank); // reorder results
+      values[AVG_WEIGHT] = AverageEdgeWeight(tWD.memptr(), tWD.n_elem);
+      values[COR_DEGREE] = Correlation(obsWD[mi], tWD.memptr(), tWD.n_elem);
+    }
     
-    tNC = NodeContribution(tData.begin(), nSamples, nNodes, 
-                           tIdx.memptr(), mNodes, tSP.memptr());
-    tNC = tNC(tRank); // reorder results
-    R_CheckUserInterrupt(); 
+    if (withData) {
+      arma::vec tSP = SplitSummaryProfile(nSplit, tDataAddr, nSamples, 
+                                          tIdx[mi].memptr(), mNodes);
+      arma::vec tNC = SplitNodeContribution(nSplit, tDataAddr, nSamples, 
+                                            tIdx[mi].memptr(), mNodes, 
+                                            tSP.memptr());
+      tNC = tNC(tRank); // reorder results
+      values[COHERENCE] = ModuleCoherence(tNC.memptr(), tNC.n_elem);
+      values[COR_CONTRIB] = Correlation(obsNC[mi], tNC.memptr(), tNC.n_elem);
+      values[AVG_CONTRIB] = SignAwareMean(obsNC[mi], tNC.memptr(), tNC.n_elem);
+    }
     
-    /* Calculate and store test statistics in the appropriate location in the 
-    * results matrix
-    */
-    obs(modIdx, 0) = AverageEdgeWeight(tWD.memptr(), tWD.n_elem);
-    obs(modIdx, 1) = ModuleCoherence(tNC.memptr(), tNC.n_elem);
-    obs(modIdx, 2) = Correlation(addrCV[mod], tCV.memptr(), tCV.n_elem);
-    obs(modIdx, 3) = Correlation(addrWD[mod], tWD.memptr(), tWD.n_elem);
-    obs(modIdx, 4) = Correlation(addrNC[mod], tNC.memptr(), tNC.n_elem);
-    obs(modIdx, 5) = SignAwareMean(addrCV[mod], tCV.memptr(), tCV.n_elem);
-    obs(modIdx, 6) = SignAwareMean(addrNC[mod], tNC.memptr(), tNC.n_elem);
+    // Store the requested statistics in the appropriate location in the 
+    // results matrix
+    for (unsigned int si = 0; si < nStats; ++si) {
+      obs(modIdx, si) = values[statIdx[si]];
+    }
+  };
+  
+  std::vector<double> cost (modsPresent.size());
+  for (unsigned int mi = 0; mi < modsPresent.size(); ++mi) {
+    cost[mi] = ModuleCost(tIdx[mi].n_elem, withData ? nSamples : 0);
   }
+  ForEachModule(cost, nThreads, calculate);
+  
+  // Convert any NaNs or Infinites to NA_REALs
+  obs.elem(arma::find_nonfinite(obs)).fill(NA_REAL);
   
   // Just return observed statistics if no permutations requested
   if (nPerm == 0) {
-    // Convert any NaNs or Infinites to NA_REALs
-    obs.elem(arma::find_nonfinite(obs)).fill(NA_REAL);
-    
-    // Convert matrix of observed test statistics into an R object before
-    // returning
-    Rcpp::NumericMatrix observed (obs.n_rows, obs.n_cols, obs.begin());
-    colnames(observed) = Rcpp::CharacterVector(statnames.begin(), statnames.end());
-    rownames(observed) = modules;
-    
     return Rcpp::List::create(Rcpp::Named("observed") = observed);
   }
 
   // If there are permutations requested, proceed.
   
-  // Initialise results container for storing the null distributions
-  arma::cube nulls (mods.size(), 7, nPerm); 
-  nulls.fill(NA_REAL);
+  // Initialise results container for storing the null distributions. The R
+  // array is allocated up front and the threads write into it directly. If
+  // a 'nullsFile' is provided, the threads write into a memory mapping of
+  // that file instead. If the nulls are not being kept at all, each thread
+  // keeps 3 slices of tallies (see 'TallyNulls'), and optionally the tails 
+  // of the null distributions (see 'TallyTails').
+  const bool keep = keepNulls[0];
+  const bool keepTail = !keep && keepTails[0];
+  const std::size_t tailsSize = (std::size_t)mods.size() * nStats * 2 * 
+                                TAIL_SIZE;
+  std::vector<double> tails;
+  const bool toFile = keep && nullsFile.size() > 0;
+  Rcpp::NumericVector nullsArray;
+  arma::ucube tallies;
+  std::unique_ptr<NullsFile> file;
+  std::unique_ptr<std::atomic<unsigned char>[]> done;
+  // Completed permutations are flagged when checkpointing, or if the 
+  // procedure may be stopped part way through by the time limit
+  const bool limited = timeLimit[0] > 0;
+  if (toFile || limited) {
+    done.reset(new std::atomic<unsigned char>[nPerm]());
+  }
+  unsigned int nDone = 0; // permutations completed before resuming
+  double * nullsAddr = NULL;
+  if (toFile) {
+    const std::string path = Rcpp::as<std::string>(nullsFile[0]);
+    if (resume[0] && std::ifstream(path.c_str()).good()) {
+      file.reset(new NullsFile(path, true));
+      if (!file->Matches(mods, statnames, nPerm, seed[0], obs.memptr())) {
+        throw Rcpp::exception(("cannot resume from " + path + ": it was " +
+          "created by a different analysis").c_str());
+      }
+      for (unsigned int ii = 0; ii < nPerm; ++ii) {
+        done[ii] = file->Done()[ii];
+      }
+      nDone = file->NumCompleted();
+      vCat(verbose, 1, "Resuming from", nDone, 
+           "completed permutations...");
+    } else {
+      file.reset(new NullsFile(path, mods, statnames, nPerm, seed[0]));
+      std::copy(obs.begin(), obs.end(), file->Observed());
+      std::fill(file->Data(), file->Data() + (std::size_t)mods.size() * nStats * nPerm, 
+                NA_REAL);
+    }
+    nullsAddr = file->Data();
+  } else if (keep) {
+    std::vector<std::string> permNames(nPerm);
+    for (unsigned int ii = 0; ii < permNames.size(); ++ii) {
+      permNames[ii] = "permutation." + std::to_string(ii + 1);
+    }
+    nullsArray = Rcpp::NumericVector((std::size_t)mods.size() * nStats * nPerm, NA_REAL);
+    nullsArray.attr("dim") = Rcpp::IntegerVector::create(mods.size(), nStats, nPerm);
+    nullsArray.attr("dimnames") = Rcpp::List::create(
+      modules, Rcpp::CharacterVector(statnames.begin(), statnames.end()), 
+      permNames);
+    nullsAddr = nullsArray.begin();
+  } else {
+    tallies.zeros(mods.size(), nStats, 3*nThreads);
+    if (keepTail) {
+      tails.resize(tailsSize * nThreads);
+    }
+  }
   
   /* For the permutation procedure, we need to shuffle a vector of *valid*
   * indices in the test network: if the null hypothesis is "overlap" (the
@@ -321,8 +798,30 @@ Rcpp::List PermutationProcedure (
   } else { // otherwise take all nodes
     nullMap = MakeNullMap(tNames, tIdxMap, nullIdx);
   }
+  
+  // Compile the modules into an integer-indexed layout so that the threads 
+  // do not need to look anything up by name.
+  const ModulePlan plan = MakeModulePlan(modsPresent, modNodePresentMap, 
+                                         modIdxMap, nullMap, addrWD, addrCV,
+                                         addrNC);
   R_CheckUserInterrupt(); 
   
+  // Group the modules by size if sharing their null distributions
+  std::vector<int> shareGroup;
+  if (shareNulls[0]) {
+    std::map<unsigned int, int> sizeGroups;
+    for (unsigned int mi = 0; mi < plan.rows.size(); ++mi) {
+      unsigned int size = plan.offsets[mi + 1] - plan.offsets[mi];
+      if (sizeGroups.count(size) == 0) {
+        int nGroups = sizeGroups.size();
+        sizeGroups[size] = nGroups;
+      }
+      shareGroup.push_back(sizeGroups[size]);
+    }
+    vCat(verbose, 2, "Sharing null distributions between", plan.rows.size(),
+         "modules of", sizeGroups.size(), "distinct sizes");
+  }
+  
   if (nThreads == 1) {
     vCat(verbose, 1, "Generating null distributions from", nPerm, 
          "permutations using", nThreads, "thread...");
@@ -331,79 +830,204 @@ Rcpp::List PermutationProcedure (
          "permutations using", nThreads, "threads...");
   }
 
-  // Create nThreads to run the permutation procedure in parallel
-  std::thread *tt = new std::thread[nThreads];
-
-  // Determine the number of permutations for each thread
-  arma::uvec chunkPerms (nThreads, arma::fill::zeros);
-  for (unsigned int ii = 0; ii < nThreads; ++ii) {
-    chunkPerms.at(ii) = nPerm / nThreads;
-  }
-  // When the number of permtutations cannot be distributed evenly, spread the
-  // remainder out across threads.
-  for (unsigned int ii = 0; ii < nPerm % nThreads; ++ii) {
-    chunkPerms.at(ii)++;
-  }
-
-  // Set up the slice indices each thread should start at in the results cube
-  arma::uvec startIdx (nThreads, arma::fill::zeros);
-  for (unsigned int ii = 0; ii < nThreads; ++ii) {
-    for (unsigned int jj = 0; jj < ii; ++jj) {
-      startIdx.at(ii) += chunkPerms.at(jj);
-    }
+  if (withData && !BlasLibrary().empty()) {
+    vCat(verbose, 2, "BLAS threads (" + BlasLibrary() + "): 1 per permutation",
+         "thread");
   }
 
-  // Set up the progress bar
-  arma::uvec progress (nThreads, arma::fill::zeros);
+  // Threads claim small batches of permutations from a shared cursor, so
+  // that the work stays balanced even when some permutations or threads are
+  // slower than others.
+  std::atomic<unsigned int> cursor (0);
+  unsigned int batchSize = BatchSize(nPerm, nThreads);
 
-  // This variable stored on the heap will get modified to be 'true' of ^C is
-  // entered in the R terminal (see 'MonitorProgress'). Each thread will check
-  // this, then abort if it is 'true'
-  bool interrupted = false;
+  // Set up the progress bar. 'MonitorProgress' will interrupt the threads 
+  // if ^C is entered in the R terminal.
+  Progress progress (nPerm, nDone);
+  if (limited) {
+    progress.SetTimeLimit(timeLimit[0], minPermutations[0]);
+  }
 
-  // Spawn the threads
-  for (unsigned int ii = 0; ii < nThreads; ++ii) {
-    tt[ii] = std::thread(
-      calculateNulls, tData.begin(), tCorr.begin(),
-      tNet.begin(), nSamples, nNodes, std::ref(addrWD), std::ref(addrNC), 
-      std::ref(addrCV),modsPresent, modNodePresentMap, modIdxMap, nullIdx, 
-      nullMap, nulls.memptr(), nPerm, chunkPerms.at(ii), startIdx.at(ii), 
-      progress.memptr(), nThreads, ii, std::ref(interrupted)
-    );
+  // The threads cannot use R's API, so everything they need is looked up 
+  // here.
+  double * obsAddr = obs.memptr();
+  const double naValue = NA_REAL;
+  
+  // Optionally stop permuting each module once its p-values are decided
+  std::unique_ptr<SequentialStopping> stopping;
+  if (sequential[0] > 0) {
+    stopping.reset(new SequentialStopping(
+      sequential[0], alternative[0], mods.size(), nStats, obsAddr, plan.rows,
+      nPerm, nullsAddr, keep ? NULL : tallies.memptr(), nThreads, progress
+    ));
   }
 
-  MonitorProgress(nPerm, progress.memptr(), nThreads, interrupted, verboseFlag);
+  // Run the permutation procedure on every thread in the pool, using the 
+  // kernel compiled for the requested statistics
+  NullsKernel kernel = SelectKernel(components);
+  ThreadPool& pool = GetThreadPool(nThreads);
+  pool.Start([&](unsigned int ii) {
+    try {
+      kernel(
+        tDataAddr, tCorrAddr, tNetAddr, nSamples, 
+        nNodes, plan, mods.size(), statIdx, shareGroup, nullIdx, rngSeed, 
+        nullsAddr, obsAddr, 
+        keep ? NULL : tallies.slice(3*ii).memptr(), 
+        keepTail ? &tails[tailsSize * ii] : NULL, naValue, done.get(), nPerm, 
+        cursor, batchSize, progress, stopping.get()
+      );
+    } catch (...) {
+      // Stop the other threads too, the exception is rethrown by 'Wait'
+      progress.Interrupt();
+      throw;
+    }
+  });
 
-  // Wait for all the threads to finish
-  for (unsigned int ii = 0; ii < nThreads; ++ii) {
-    tt[ii].join();
+  // Periodically save the completed permutations to disk if writing to a file
+  std::function<void()> checkpoint;
+  if (toFile) {
+    checkpoint = [&file, &done]() { file->Checkpoint(done.get()); };
+  }
+  try {
+    MonitorProgress(progress, verboseFlag, checkpoint);
+  } catch (...) {
+    // The threads must finish before the memory they use is released
+    progress.Interrupt();
+    pool.Wait();
+    throw;
   }
 
-  // Convert any NaNs or Infinites to NA_REALs
-  nulls.elem(arma::find_nonfinite(nulls)).fill(NA_REAL);
-  obs.elem(arma::find_nonfinite(obs)).fill(NA_REAL);
+  // Wait for all the threads to finish
+  pool.Wait();
   
-  // Construct permutation names
-  std::vector<std::string> permNames(nPerm);
-  for (unsigned int ii = 0; ii < permNames.size(); ++ii) {
-    permNames[ii] = "permutation." + std::to_string(ii + 1);
+  // If the time limit was reached, clear any permutations the threads 
+  // abandoned part way through, so that the p-values are calculated from the
+  // completed permutations only. Abandoned permutations are never tallied.
+  Rcpp::RObject completed; // NULL unless stopped by the time limit
+  unsigned int nCompleted = nPerm;
+  if (progress.Expired()) {
+    std::vector<int> completedIdx;
+    for (unsigned int pp = 0; pp < nPerm; ++pp) {
+      if (done[pp]) {
+        completedIdx.push_back(pp + 1);
+      } else if (nullsAddr != NULL) {
+        std::fill(nullsAddr + (std::size_t)pp * mods.size() * nStats,
+                  nullsAddr + (std::size_t)(pp + 1) * mods.size() * nStats, 
+                  NA_REAL);
+      }
+    }
+    completed = Rcpp::IntegerVector(completedIdx.begin(), completedIdx.end());
+    nCompleted = completedIdx.size();
+    vCat(verbose, 1, "Time limit reached after", nCompleted, "of", nPerm, 
+         "permutations");
   }
   
-  // Convert cube of null distribution objects into an R array before returning
-  Rcpp::NumericVector nullsArray (nulls.begin(), nulls.end());
-  nullsArray.attr("dim") = Rcpp::IntegerVector::create(mods.size(), 7, nPerm);
-  nullsArray.attr("dimnames") = Rcpp::List::create(
-    modules, Rcpp::CharacterVector(statnames.begin(), statnames.end()), 
-    permNames);
+  // Record how many permutations each module was run for
+  Rcpp::RObject nPermRun; // NULL unless stopping early
+  if (stopping) {
+    // Modules still running when the time limit was reached ran every 
+    // completed permutation: the rounds are always completed in order.
+    for (unsigned int ii = 0; ii < stopping->permutations.size(); ++ii) {
+      stopping->permutations[ii] = std::min(stopping->permutations[ii], 
+                                            nCompleted);
+    }
+    Rcpp::IntegerVector permsRun (stopping->permutations.begin(), 
+                                  stopping->permutations.end());
+    permsRun.names() = modules;
+    nPermRun = permsRun;
+    unsigned int nStopped = 0;
+    for (unsigned int ii = 0; ii < plan.rows.size(); ++ii) {
+      nStopped += stopping->permutations[plan.rows[ii]] < nPerm;
+    }
+    vCat(verbose, 1, "Stopped the permutations early for", nStopped, "of", 
+         plan.rows.size(), "modules");
+  }
+
+  if (!keep) {
+    // Sum the tallies across threads
+    arma::cube counts (mods.size(), nStats, 3, arma::fill::zeros);
+    for (unsigned int ii = 0; ii < nThreads; ++ii) {
+      for (unsigned int kk = 0; kk < 3; ++kk) {
+        counts.slice(kk) += arma::conv_to<arma::mat>::from(tallies.slice(3*ii + kk));
+      }
+    }
+    
+    Rcpp::NumericVector countsArray (counts.begin(), counts.end());
+    countsArray.attr("dim") = Rcpp::IntegerVector::create(mods.size(), nStats, 3);
+    countsArray.attr("dimnames") = Rcpp::List::create(
+      modules, Rcpp::CharacterVector(statnames.begin(), statnames.end()), 
+      Rcpp::CharacterVector::create("less.extreme", "more.extreme", "n.perm"));
+    
+    // Merge the tails kept by each thread, with the most extreme values first
+    Rcpp::RObject tailsArray; // NULL unless the tails were kept
+    if (keepTail) {
+      const unsigned int nCells = mods.size() * nStats;
+      Rcpp::NumericVector merged ((std::size_t)nCells * TAIL_SIZE * 2, NA_REAL);
+      std::vector<double> upper, lower;
+      for (unsigned int ci = 0; ci < nCells; ++ci) {
+        upper.clear();
+        lower.clear();
+        for (unsigned int ii = 0; ii < nThreads; ++ii) {
+          unsigned int nKept = std::min(tallies.slice(3*ii + 2)[ci], 
+                                        (unsigned int)TAIL_SIZE);
+          double * threadTails = &tails[tailsSize * ii];
+          upper.insert(upper.end(), threadTails + (std::size_t)ci * TAIL_SIZE,
+                       threadTails + (std::size_t)ci * TAIL_SIZE + nKept);
+          lower.insert(lower.end(), 
+                       threadTails + (std::size_t)(nCells + ci) * TAIL_SIZE,
+                       threadTails + (std::size_t)(nCells + ci) * TAIL_SIZE + nKept);
+        }
+        std::sort(upper.begin(), upper.end(), std::greater<double>());
+        std::sort(lower.begin(), lower.end());
+        std::size_t nTail = std::min(upper.size(), (std::size_t)TAIL_SIZE);
+        for (std::size_t kk = 0; kk < nTail; ++kk) {
+          merged[ci + (std::size_t)nCells * kk] = upper[kk];
+          merged[ci + (std::size_t)nCells * (TAIL_SIZE + kk)] = lower[kk];
+        }
+      }
+      merged.attr("dim") = Rcpp::IntegerVector::create(
+        mods.size(), nStats, TAIL_SIZE, 2);
+      merged.attr("dimnames") = Rcpp::List::create(
+        modules, Rcpp::CharacterVector(statnames.begin(), statnames.end()), 
+        R_NilValue, Rcpp::CharacterVector::create("upper", "lower"));
+      tailsArray = merged;
+    }
+    
+    return Rcpp::List::create(
+      Rcpp::Named("counts") = countsArray,
+      Rcpp::Named("observed") = observed,
+      Rcpp::Named("nPermRun") = nPermRun,
+      Rcpp::Named("completed") = completed,
+      Rcpp::Named("tails") = tailsArray
+    );
+  }
   
-  // Convert matrix of observed test statistics into an R object before
-  // returning
-  Rcpp::NumericMatrix observed (obs.n_rows,  obs.n_cols, obs.begin());
-  colnames(observed) = Rcpp::CharacterVector(statnames.begin(), statnames.end());
-  rownames(observed) = modules;
+  if (toFile) {
+    // Permutations skipped once every module stopped early are complete too
+    if (stopping && !progress.Interrupted()) {
+      for (unsigned int ii = 0; ii < nPerm; ++ii) {
+        done[ii] = 1;
+      }
+    }
+    file->Checkpoint(done.get());
+    if (progress.Interrupted() && !progress.Expired()) {
+      throw Rcpp::exception(("permutation procedure interrupted: completed " 
+        "permutations have been saved to " + Rcpp::as<std::string>(nullsFile[0]) + 
+        " and can be resumed with 'resume=TRUE'").c_str());
+    }
+    
+    return Rcpp::List::create(
+      Rcpp::Named("nullsFile") = nullsFile[0],
+      Rcpp::Named("observed") = observed,
+      Rcpp::Named("nPermRun") = nPermRun,
+      Rcpp::Named("completed") = completed
+    );
+  }
   
   return Rcpp::List::create(
     Rcpp::Named("nulls") = nullsArray,
-    Rcpp::Named("observed") = observed
+    Rcpp::Named("observed") = observed,
+    Rcpp::Named("nPermRun") = nPermRun,
+    Rcpp::Named("completed") = completed
   );
 }
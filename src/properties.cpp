@@ -1,6 +1,8 @@
 #include "utils.h"
 #include "netStats.h"
 #include "scale.h"
+#include "thread-utils.h"
+#include "largeModules.h"
 
 ///' Calculate the network properties 
 ///' 
@@ -32,6 +34,8 @@
 ///'   each node belongs to in the discovery dataset. 
 ///' @param modules a character vector of modules for which to calculate the 
 ///'   network properties for.
+///' @param nCores number of threads to calculate the properties of different
+///'   modules on in parallel.
 ///' 
 ///' @return a list containing the summary profile, node contribution, module
 ///'   coherence, weighted degree, and average edge weight for each 'module'.
@@ -41,7 +45,7 @@
 Rcpp::List NetProps (
     Rcpp::NumericMatrix data, Rcpp::NumericMatrix net, 
     Rcpp::CharacterVector moduleAssignments,
-    Rcpp::CharacterVector modules
+    Rcpp::CharacterVector modules, Rcpp::IntegerVector nCores
 ) {
   // First, scale the matrix data
   unsigned int nSamples = data.nrow();
@@ -68,75 +72,88 @@ Rcpp::List NetProps (
   
   R_CheckUserInterrupt(); 
   
-  // Calculate the network properties for each module
-  std::string mod; // iterators
+  // Look up each module's nodes before going parallel: the threads cannot 
+  // use R's API.
+  std::vector<std::vector<std::string>> modNodeNames (mods.size());
+  std::vector<arma::uvec> nodeIdx (mods.size()), propIdx (mods.size());
+  for (unsigned int mi = 0; mi < mods.size(); ++mi) {
+    std::string mod = mods[mi];
+    modNodeNames[mi] = GetModNodeNames(mod, modNodeMap);
+    
+    // Get just the indices of nodes that are present in the requested 
+    // dataset, and a mapping of those nodes to the result vectors
+    nodeIdx[mi] = GetNodeIdx(mod, modNodePresentMap, nodeIdxMap);
+    propIdx[mi] = GetNodeIdx(mod, modNodePresentMap, 
+                             MakeIdxMap(modNodeNames[mi]));
+  }
+  double * netAddr = net.begin();
+  double * dataAddr = scaledData.memptr();
+  
+  // Calculate the network properties of module 'mi', splitting the work 
+  // across 'nSplit' threads. Each module's results go in their own slot.
+  std::vector<arma::vec> WD (mods.size()), SP (mods.size()), NC (mods.size());
+  auto calculate = [&](unsigned int mi, unsigned int nSplit) {
+    unsigned int mNodesPresent = nodeIdx[mi].n_elem;
+    if (mNodesPresent == 0) {
+      return; // nothing to calculate for modules without nodes in the dataset
+    }
+    
+    // sort the node indices for sequential memory access
+    arma::uvec nodeRank = SortNodes(nodeIdx[mi].memptr(), mNodesPresent);
+    
+    WD[mi] = SplitWeightedDegree(nSplit, netAddr, nNodes, 
+                                 nodeIdx[mi].memptr(), mNodesPresent);
+    WD[mi] = WD[mi](nodeRank); // reorder results
+    
+    SP[mi] = SplitSummaryProfile(nSplit, dataAddr, nSamples, 
+                                 nodeIdx[mi].memptr(), mNodesPresent);
+    
+    NC[mi] = SplitNodeContribution(nSplit, dataAddr, nSamples, 
+                                   nodeIdx[mi].memptr(), mNodesPresent, 
+                                   SP[mi].memptr());
+    NC[mi] = NC[mi](nodeRank); // reorder results
+  };
+  
+  std::vector<double> cost (mods.size());
+  for (unsigned int mi = 0; mi < mods.size(); ++mi) {
+    cost[mi] = ModuleCost(nodeIdx[mi].n_elem, nSamples);
+  }
+  ForEachModule(cost, nCores[0], calculate);
+  R_CheckUserInterrupt(); 
+  
+  // Cast to R-vectors and add to results lists
   unsigned int mNodesPresent, mNodes;
-  arma::uvec nodeIdx, propIdx, nodeRank;
-  namemap propIdxMap;
-  std::vector<std::string> modNodeNames; 
-  arma::vec WD, SP, NC; // results containers
   double avgWeight, coherence; 
   Rcpp::NumericVector degree, summary, contribution; // for casting to R equivalents
   Rcpp::List results; // final storage container
-  for (auto mi = mods.begin(); mi != mods.end(); ++mi) {
-    // What nodes are in this module?
-    mod = *mi;
-    modNodeNames = GetModNodeNames(mod, modNodeMap);
-    
+  for (unsigned int mi = 0; mi < mods.size(); ++mi) {
     // initialise results containers with NA values for nodes not present in
     // the dataset we're calculating the network properties in.
-    degree = Rcpp::NumericVector(modNodeNames.size(), NA_REAL);
-    contribution = Rcpp::NumericVector(modNodeNames.size(), NA_REAL);
+    degree = Rcpp::NumericVector(modNodeNames[mi].size(), NA_REAL);
+    contribution = Rcpp::NumericVector(modNodeNames[mi].size(), NA_REAL);
     summary = Rcpp::NumericVector(nSamples, NA_REAL);
     avgWeight = NA_REAL;
     coherence = NA_REAL;
-    degree.names() = modNodeNames;
-    contribution.names() = modNodeNames;
-    
-    // Create a mapping between node names and the result vectors
-    propIdxMap = MakeIdxMap(modNodeNames);
-    
-    // Get just the indices of nodes that are present in the requested dataset
-    nodeIdx = GetNodeIdx(mod, modNodePresentMap, nodeIdxMap);
-    mNodesPresent = nodeIdx.n_elem;
+    degree.names() = modNodeNames[mi];
+    contribution.names() = modNodeNames[mi];
     
-    // And a mapping of those nodes to the initialised vectors
-    propIdx = GetNodeIdx(mod, modNodePresentMap, propIdxMap);
-    mNodes = propIdx.n_elem;
-    
-    // Calculate the properties if the module has nodes in the test dataset
-    if (nodeIdx.n_elem > 0) {
-      // sort the node indices for sequential memory access
-      nodeRank = SortNodes(nodeIdx.memptr(), mNodesPresent);
-      
-      WD = WeightedDegree(net.begin(), nNodes, nodeIdx.memptr(), mNodesPresent);
-      WD = WD(nodeRank); // reorder results
-      
-      avgWeight = AverageEdgeWeight(WD.memptr(), WD.n_elem);
-      R_CheckUserInterrupt(); 
-      
-      SP = SummaryProfile(scaledData.memptr(), nSamples, nNodes, 
-                          nodeIdx.memptr(), mNodesPresent);
-      R_CheckUserInterrupt(); 
-      
-      NC = NodeContribution(scaledData.memptr(), nSamples, nNodes, 
-                            nodeIdx.memptr(), mNodesPresent, SP.memptr());
-      NC = NC(nodeRank); // reorder results
-      
-      coherence = ModuleCoherence(NC.memptr(), mNodesPresent);
-      R_CheckUserInterrupt();
+    mNodesPresent = nodeIdx[mi].n_elem;
+    mNodes = propIdx[mi].n_elem;
+    if (mNodesPresent > 0) {
+      avgWeight = AverageEdgeWeight(WD[mi].memptr(), WD[mi].n_elem);
+      coherence = ModuleCoherence(NC[mi].memptr(), mNodesPresent);
       
       // Convert NaNs to NAs
-      SP.elem(arma::find_nonfinite(SP)).fill(NA_REAL);
-      NC.elem(arma::find_nonfinite(NC)).fill(NA_REAL);
+      SP[mi].elem(arma::find_nonfinite(SP[mi])).fill(NA_REAL);
+      NC[mi].elem(arma::find_nonfinite(NC[mi])).fill(NA_REAL);
       if (!arma::is_finite(coherence)) {
         coherence = NA_REAL;
       }
 
       // Fill results vectors
-      Fill(degree, WD.memptr(), mNodesPresent, propIdx.memptr(), mNodes);
-      Fill(contribution, NC.memptr(), mNodesPresent, propIdx.memptr(), mNodes);
-      summary = Rcpp::NumericVector(SP.begin(), SP.end());
+      Fill(degree, WD[mi].memptr(), mNodesPresent, propIdx[mi].memptr(), mNodes);
+      Fill(contribution, NC[mi].memptr(), mNodesPresent, propIdx[mi].memptr(), mNodes);
+      summary = Rcpp::NumericVector(SP[mi].begin(), SP[mi].end());
     }
     summary.names() = sampleNames;
     
@@ -181,6 +198,8 @@ Rcpp::List NetProps (
 ///'   each node belongs to in the discovery dataset. 
 ///' @param modules a character vector of modules for which to calculate the 
 ///'   network properties for.
+///' @param nCores number of threads to calculate the properties of different
+///'   modules on in parallel.
 ///' 
 ///' @return a list containing the summary profile, node contribution, module
 ///'   coherence, weighted degree, and average edge weight for each 'module'.
@@ -190,7 +209,7 @@ Rcpp::List NetProps (
 Rcpp::List NetPropsNoData (
     Rcpp::NumericMatrix net, 
     Rcpp::CharacterVector moduleAssignments,
-    Rcpp::CharacterVector modules
+    Rcpp::CharacterVector modules, Rcpp::IntegerVector nCores
 ) {
   // convert the colnames / rownames to C++ equivalents
   const std::vector<std::string> nodeNames (Rcpp::as<std::vector<std::string>>(colnames(net)));
@@ -212,52 +231,65 @@ Rcpp::List NetPropsNoData (
   
   R_CheckUserInterrupt(); 
   
-  // Calculate the network properties for each module
-  std::string mod; // iterators
+  // Look up each module's nodes before going parallel: the threads cannot 
+  // use R's API.
+  std::vector<std::vector<std::string>> modNodeNames (mods.size());
+  std::vector<arma::uvec> nodeIdx (mods.size()), propIdx (mods.size());
+  for (unsigned int mi = 0; mi < mods.size(); ++mi) {
+    std::string mod = mods[mi];
+    modNodeNames[mi] = GetModNodeNames(mod, modNodeMap);
+    
+    // Get just the indices of nodes that are present in the requested 
+    // dataset, and a mapping of those nodes to the result vectors
+    nodeIdx[mi] = GetNodeIdx(mod, modNodePresentMap, nodeIdxMap);
+    propIdx[mi] = GetNodeIdx(mod, modNodePresentMap, 
+                             MakeIdxMap(modNodeNames[mi]));
+  }
+  double * netAddr = net.begin();
+  
+  // Calculate the weighted degree of module 'mi', splitting the work across
+  // 'nSplit' threads.
+  std::vector<arma::vec> WD (mods.size());
+  auto calculate = [&](unsigned int mi, unsigned int nSplit) {
+    unsigned int mNodesPresent = nodeIdx[mi].n_elem;
+    if (mNodesPresent == 0) {
+      return; // nothing to calculate for modules without nodes in the dataset
+    }
+    
+    // sort the node indices for sequential memory access
+    arma::uvec nodeRank = SortNodes(nodeIdx[mi].memptr(), mNodesPresent);
+    
+    WD[mi] = SplitWeightedDegree(nSplit, netAddr, nNodes, 
+                                 nodeIdx[mi].memptr(), mNodesPresent);
+    WD[mi] = WD[mi](nodeRank); // reorder results
+  };
+  
+  std::vector<double> cost (mods.size());
+  for (unsigned int mi = 0; mi < mods.size(); ++mi) {
+    cost[mi] = ModuleCost(nodeIdx[mi].n_elem, 0);
+  }
+  ForEachModule(cost, nCores[0], calculate);
+  R_CheckUserInterrupt(); 
+  
+  // Cast to R-vectors and add to results lists
   unsigned int mNodesPresent, mNodes;
-  arma::uvec nodeIdx, propIdx, nodeRank;
-  namemap propIdxMap;
-  std::vector<std::string> modNodeNames; 
-  arma::vec WD; // results containers
   double avgWeight; 
   Rcpp::NumericVector degree; // for casting to R equivalents
   Rcpp::List results; // final storage container
-  for (auto mi = mods.begin(); mi != mods.end(); ++mi) {
-    // What nodes are in this module?
-    // modNodeNames = names(moduleAssignments[moduleAssignments == mod])
-    mod = *mi;
-    modNodeNames = GetModNodeNames(mod, modNodeMap);
-    
+  for (unsigned int mi = 0; mi < mods.size(); ++mi) {
     // initialise results containers with NA values for nodes not present in
     // the dataset we're calculating the network properties in.
-    degree = Rcpp::NumericVector(modNodeNames.size(), NA_REAL);
+    degree = Rcpp::NumericVector(modNodeNames[mi].size(), NA_REAL);
     avgWeight = NA_REAL;
-    degree.names() = modNodeNames;
-    
-    // Create a mapping between node names and the result vectors
-    propIdxMap = MakeIdxMap(modNodeNames);
+    degree.names() = modNodeNames[mi];
     
-    // Get just the indices of nodes that are present in the requested dataset
-    nodeIdx = GetNodeIdx(mod, modNodePresentMap, nodeIdxMap);
-    mNodesPresent = nodeIdx.n_elem;
-    
-    // And a mapping of those nodes to the initialised vectors
-    propIdx = GetNodeIdx(mod, modNodePresentMap, propIdxMap);
-    mNodes = propIdx.n_elem;
-
-    // Calculate the properties if the module has nodes in the test dataset
-    if (nodeIdx.n_elem > 0) {
-      // sort the node indices for sequential memory access
-      nodeRank = SortNodes(nodeIdx.memptr(), mNodesPresent);
-      
-      WD = WeightedDegree(net.begin(), nNodes, nodeIdx.memptr(), mNodesPresent);
-      WD = WD(nodeRank); // reorder results
-      
-      avgWeight = AverageEdgeWeight(WD.memptr(), WD.n_elem);
-      R_CheckUserInterrupt(); 
+    mNodesPresent = nodeIdx[mi].n_elem;
+    mNodes = propIdx[mi].n_elem;
+    if (mNodesPresent > 0) {
+      avgWeight = AverageEdgeWeight(WD[mi].memptr(), WD[mi].n_elem);
       
       // Fill the results vectors appropriately
-      Fill(degree, WD.memptr(), mNodesPresent, propIdx.memptr(), mNodes);
+      Fill(degree, WD[mi].memptr(), mNodesPresent, propIdx[mi].memptr(), mNodes);
     }
 
     results.push_back(
@@ -0,0 +1,113 @@
+#include "rng.h"
+
+/* SplitMix64 step, used to expand the seed and stream index into a full
+ * generator state.
+ */
+static uint64_t SplitMix64 (uint64_t& x) {
+  uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t Rotl (const uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+/* Initialise the generator for a given stream
+ * 
+ * @param seed the user-provided seed.
+ * @param stream the stream index (i.e. the permutation number).
+ */
+PermutationRNG::PermutationRNG (uint64_t seed, uint64_t stream) {
+  // Hash the seed and stream index together so that neighbouring streams
+  // start from unrelated states.
+  uint64_t sm = seed;
+  uint64_t key = SplitMix64(sm) ^ stream;
+  SplitMix64(key);
+  for (unsigned int ii = 0; ii < 4; ++ii) {
+    state[ii] = SplitMix64(key);
+  }
+}
+
+/* Draw the next 64 random bits from the stream
+ */
+uint64_t PermutationRNG::Next () {
+  const uint64_t result = Rotl(state[1] * 5, 7) * 9;
+  const uint64_t t = state[1] << 17;
+  
+  state[2] ^= state[0];
+  state[3] ^= state[1];
+  state[1] ^= state[2];
+  state[0] ^= state[3];
+  state[2] ^= t;
+  state[3] = Rotl(state[3], 45);
+  
+  return result;
+}
+
+/* Draw an integer uniformly from [0, n)
+ * 
+ * Uses Lemire's multiply-and-reject method, which avoids the modulo bias of
+ * 'Next() % n' without needing a division on most draws.
+ * 
+ * @param n upper bound (exclusive), must be greater than 0.
+ */
+unsigned int PermutationRNG::Uniform (unsigned int n) {
+  uint64_t m = (Next() >> 32) * (uint64_t)n;
+  uint32_t low = (uint32_t)m;
+  if (low < n) {
+    uint32_t threshold = (uint32_t)(-n) % n;
+    while (low < threshold) {
+      m = (Next() >> 32) * (uint64_t)n;
+      low = (uint32_t)m;
+    }
+  }
+  return (unsigned int)(m >> 32);
+}
+
+/* Draw a random sample of 'k' elements without replacement (partial 
+ * Fisher-Yates)
+ * 
+ * Only the first 'k' elements of 'x' are shuffled into place, so the cost is
+ * proportional to 'k' rather than 'n'. The positions swapped in are recorded
+ * in 'swaps' so that 'x' can be restored to its original order afterwards 
+ * with 'UndoShuffle'.
+ * 
+ * @param x memory address of the vector to sample from. On return, the first
+ *   'k' elements contain the sample.
+ * @param n number of elements in 'x'.
+ * @param k number of elements to draw. Must be no greater than 'n'.
+ * @param rng random number stream to draw from.
+ * @param swaps memory address of a vector of length 'k' to record the swaps
+ *   in.
+ */
+void PartialShuffle (
+  unsigned int * x, unsigned int n, unsigned int k, PermutationRNG& rng,
+  unsigned int * swaps
+) {
+  unsigned int jj, tmp;
+  for (unsigned int ii = 0; ii < k; ++ii) {
+    jj = ii + rng.Uniform(n - ii);
+    swaps[ii] = jj;
+    tmp = x[ii];
+    x[ii] = x[jj];
+    x[jj] = tmp;
+  }
+}
+
+/* Restore a vector to its order before a call to 'PartialShuffle'
+ * 
+ * @param x memory address of the vector passed to 'PartialShuffle'.
+ * @param k number of elements that were drawn.
+ * @param swaps memory address of the swaps recorded by 'PartialShuffle'.
+ */
+void UndoShuffle (unsigned int * x, unsigned int k, unsigned int * swaps) {
+  unsigned int jj, tmp;
+  for (unsigned int ii = k; ii > 0; --ii) {
+    jj = swaps[ii - 1];
+    tmp = x[ii - 1];
+    x[ii - 1] = x[jj];
+    x[jj] = tmp;
+  }
+}
@@ -0,0 +1,26 @@
+#ifndef __RNG__
+#define __RNG__
+
+#include <cstdint>
+
+/* Random number generator for the permutation procedure
+ * 
+ * A xoshiro256** generator whose state is derived from a user-provided seed
+ * and a stream index. Each permutation draws from its own stream, so the
+ * random node sets drawn for permutation 'k' are the same regardless of the 
+ * number of threads, or which thread happens to compute that permutation. 
+ * Unlike R's random number generator, each stream is entirely thread-local.
+ */
+class PermutationRNG {
+public:
+  PermutationRNG (uint64_t, uint64_t);
+  uint64_t Next ();
+  unsigned int Uniform (unsigned int);
+private:
+  uint64_t state[4];
+};
+
+void PartialShuffle (unsigned int *, unsigned int, unsigned int, PermutationRNG&, unsigned int *);
+void UndoShuffle (unsigned int *, unsigned int, unsigned int *);
+
+#endif // __RNG__
@@ -0,0 +1,194 @@
+#include "sequential.h"
+#include "utils.h"
+#include <boost/math/distributions/binomial.hpp>
+
+/* Set up sequential stopping for a permutation procedure
+ *
+ * @param threshold significance threshold that the p-values are compared to.
+ * @param alternative index of the alternative hypothesis in
+ *   c("two.sided", "less", "greater").
+ * @param nMods number of rows in the results.
+ * @param nStatistics number of statistics (columns) in the results.
+ * @param obs memory address of the matrix of observed statistics.
+ * @param rows rows in the results of the modules being permuted, see
+ *   'ModulePlan'. All other rows are never active.
+ * @param nPermutations total number of permutations.
+ * @param nulls memory address of the null distributions, or NULL if only
+ *   the tallies are being kept.
+ * @param tallies memory address of the first thread's tallies, see
+ *   'TallyNulls'. Only used if 'nulls' is NULL.
+ * @param nThreads number of threads claiming permutations. Each thread keeps
+ *   its own tallies, one after another from 'tallies'.
+ * @param prog progress shared with 'MonitorProgress'. Permutations skipped
+ *   once every module has stopped are counted as complete.
+ */
+SequentialStopping::SequentialStopping (
+  double threshold, unsigned int alternative, unsigned int nMods,
+  unsigned int nStatistics, double * obs, const std::vector<unsigned int>& rows,
+  unsigned int nPermutations, double * nulls, unsigned int * tallies,
+  unsigned int nThreads, Progress& prog
+) : permutations(nMods, 0), threshold(threshold), alternative(alternative),
+    nModules(nMods), nStats(nStatistics), obsAddr(obs), nPerm(nPermutations),
+    nullsAddr(nulls), talliesAddr(tallies), nTallies(nThreads), progress(prog),
+    active(nMods, 0), counts(nMods * nStatistics * 3, 0),
+    cursor(0), roundStart(0), nFinished(0)
+{
+  for (unsigned int ii = 0; ii < rows.size(); ++ii) {
+    active[rows[ii]] = 1;
+    permutations[rows[ii]] = nPerm;
+  }
+  roundEnd = std::min(nPerm, (unsigned int)SEQUENTIAL_FIRST_LOOK);
+
+  // The error is split evenly between the looks, and then between the 
+  // statistics of each module in 'Decide', so that the chance of any look 
+  // stopping a module on the wrong side of the threshold is at most 
+  // 'SEQUENTIAL_ERROR'.
+  unsigned int nLooks = 0;
+  for (unsigned long look = SEQUENTIAL_FIRST_LOOK; look < nPerm; look *= 2) {
+    nLooks++;
+  }
+  error = SEQUENTIAL_ERROR / std::max(nLooks, 1u);
+}
+
+/* Claim the next batch of permutations in the current round
+ *
+ * Used instead of 'ClaimBatch' in the permutation workers. Blocks until
+ * the next round starts if all permutations in the current round have been
+ * claimed.
+ *
+ * @param batchSize maximum number of permutations to claim at a time, see
+ *   'BatchSize'. Reduced in the early rounds so that every thread gets a
+ *   share of them.
+ * @param start set to the index of the first permutation in the claimed
+ *   batch.
+ * @param end set to one past the index of the last permutation in the
+ *   claimed batch.
+ *
+ * @return 'false' if there are no permutations left to claim, or the
+ *   permutation procedure has been interrupted.
+ */
+bool SequentialStopping::ClaimBatch (
+  unsigned int batchSize, unsigned int& start, unsigned int& end
+) {
+  std::unique_lock<std::mutex> lock (mutex);
+  while (cursor >= roundEnd) {
+    if (roundEnd >= nPerm || progress.Interrupted()) {
+      return false;
+    }
+    // Interrupts do not notify 'nextRound', so check for them periodically
+    nextRound.wait_for(lock, std::chrono::milliseconds(100));
+  }
+  batchSize = std::min(batchSize, BatchSize(roundEnd - roundStart, nTallies));
+  start = cursor;
+  end = std::min(cursor + batchSize, roundEnd);
+  cursor = end;
+  return true;
+}
+
+/* Is a row of the results still being permuted?
+ *
+ * Only changes between rounds, while no other thread is calculating a
+ * permutation, so it can be read without locking.
+ */
+bool SequentialStopping::Active (unsigned int row) const {
+  return active[row] != 0;
+}
+
+/* Count a finished permutation
+ *
+ * Must be called by the workers after a permutation's statistics have been
+ * written or tallied. The thread finishing the last permutation in a round
+ * decides which modules to stop and starts the next round.
+ */
+void SequentialStopping::Finished () {
+  std::lock_guard<std::mutex> lock (mutex);
+  if (++nFinished == roundEnd && roundEnd < nPerm) {
+    Decide();
+    nextRound.notify_all();
+  }
+}
+
+/* Stop the modules whose p-values are confidently decided
+ *
+ * A statistic is decided once a Clopper-Pearson confidence interval for
+ * its p-value, calculated from the permutations so far, lies entirely above
+ * or below the threshold. For two-sided tests the smaller tail is compared
+ * to half the threshold, matching 'countsTest'. A module is stopped once
+ * all of its statistics are decided. Statistics with missing observed
+ * values have nothing to decide. The error allowed at each look is split 
+ * evenly between the module's statistics with observed values, so that the
+ * chance of stopping the module with any p-value on the wrong side of the
+ * threshold is at most 'SEQUENTIAL_ERROR' over all looks.
+ */
+void SequentialStopping::Decide () {
+  unsigned int nCells = nModules * nStats;
+  if (nullsAddr != NULL) {
+    for (unsigned int pp = roundStart; pp < roundEnd; ++pp) {
+      TallyNulls(nullsAddr + (std::size_t)pp * nCells, obsAddr, nModules,
+                 nStats, &counts[0]);
+    }
+  } else {
+    std::fill(counts.begin(), counts.end(), 0);
+    for (unsigned int tt = 0; tt < nTallies; ++tt) {
+      for (unsigned int ii = 0; ii < 3 * nCells; ++ii) {
+        counts[ii] += talliesAddr[(std::size_t)tt * 3 * nCells + ii];
+      }
+    }
+  }
+
+  double alpha = alternative == 1 ? threshold / 2 : threshold;
+  bool anyActive = false;
+  for (unsigned int mi = 0; mi < nModules; ++mi) {
+    if (!active[mi]) {
+      continue;
+    }
+    // A module is only stopped once all of its statistics are decided, so 
+    // the error at this look is split between them.
+    unsigned int nFinite = 0;
+    for (unsigned int si = 0; si < nStats; ++si) {
+      nFinite += arma::is_finite(obsAddr[si * nModules + mi]);
+    }
+    double statError = error / std::max(nFinite, 1u);
+    
+    bool decided = true;
+    for (unsigned int si = 0; si < nStats && decided; ++si) {
+      unsigned int ii = si * nModules + mi;
+      if (!arma::is_finite(obsAddr[ii])) {
+        continue;
+      }
+      unsigned int less = counts[ii];
+      unsigned int more = counts[nCells + ii];
+      unsigned int nn = counts[2*nCells + ii];
+      if (nn == 0) {
+        decided = false;
+        break;
+      }
+      unsigned int extreme = alternative == 1 ? std::min(less, more) :
+                             alternative == 2 ? less : more;
+      double lower = boost::math::binomial_distribution<>::find_lower_bound_on_p(
+        nn, extreme, statError);
+      double upper = boost::math::binomial_distribution<>::find_upper_bound_on_p(
+        nn, extreme, statError);
+      decided = upper < alpha || lower > alpha;
+    }
+    if (decided) {
+      active[mi] = 0;
+      permutations[mi] = roundEnd;
+    } else {
+      anyActive = true;
+    }
+  }
+
+  // Start the next round. Once every module has stopped the remaining
+  // permutations are skipped altogether.
+  roundStart = roundEnd;
+  if (anyActive) {
+    roundEnd = (unsigned int)std::min((unsigned long)roundEnd * 2,
+                                      (unsigned long)nPerm);
+  } else {
+    progress.Increment(nPerm - roundEnd);
+    roundEnd = nPerm;
+    cursor = nPerm;
+    nFinished = nPerm;
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef __SEQUENTIAL__
+#define __SEQUENTIAL__
+
+#include "thread-utils.h"
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// Number of permutations before the first look at the null distributions.
+// Later looks happen each time the number of permutations doubles.
+#define SEQUENTIAL_FIRST_LOOK 100
+// Probability that a module is stopped with its p-value on the wrong side
+// of the threshold, shared between all looks at the null distributions.
+#define SEQUENTIAL_ERROR 0.001
+
+/* Adaptive stopping of the permutation procedure for each module
+ *
+ * Replaces the shared cursor in 'ClaimBatch' when the permutation procedure
+ * is run sequentially. Permutations are handed out in rounds ending at
+ * 'SEQUENTIAL_FIRST_LOOK', twice that, and so on up to 'nPerm'. Once every
+ * permutation in a round is finished, the thread that finished the last one
+ * tallies the null distributions so far and stops each module whose
+ * p-values are all confidently above or below the threshold (see 'Decide'),
+ * while the other threads wait. The workers skip stopped modules for the
+ * rest of the procedure, so the remaining permutations go to the undecided
+ * modules only. Decisions only depend on completed rounds, so the results
+ * are the same regardless of the number of threads.
+ */
+class SequentialStopping {
+public:
+  SequentialStopping (double, unsigned int, unsigned int, unsigned int,
+                      double *, const std::vector<unsigned int>&, unsigned int,
+                      double *, unsigned int *, unsigned int, Progress&);
+  bool ClaimBatch (unsigned int, unsigned int&, unsigned int&);
+  bool Active (unsigned int) const;
+  void Finished ();
+  std::vector<unsigned int> permutations; // permutations run for each row
+private:
+  void Decide ();
+  const double threshold;
+  const unsigned int alternative; // as in 'countsTest'
+  const unsigned int nModules;
+  const unsigned int nStats;
+  double * obsAddr;
+  const unsigned int nPerm;
+  double * nullsAddr;
+  unsigned int * talliesAddr;
+  const unsigned int nTallies;
+  Progress& progress;
+  double error; // allowed error for each module at each look
+  std::vector<unsigned char> active; // rows still being permuted
+  std::vector<unsigned int> counts; // tallies of the completed rounds
+  unsigned int cursor; // next permutation to hand out
+  unsigned int roundStart; // first permutation of the current round
+  unsigned int roundEnd; // one past the last permutation of the current round
+  unsigned int nFinished; // permutations finished in all rounds so far
+  std::mutex mutex;
+  std::condition_variable nextRound;
+};
+
+#endif // __SEQUENTIAL__
@@ -6,50 +6,325 @@
 
 #include <RcppArmadillo.h>
 
-// header files for sleeping a thread
-#if defined (_WIN32) || defined (_WIN64)
-  // <thread> requires Rtools33 (R 3.3.0) which uses GCC 4.9.3, which supports 
-  // <chrono>
-  #include <chrono>
-#else
-  // But for linux/osx we need to handle older versions of GCC which have 
-  // <thread> but not <chrono> support
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+#include "thread-utils.h"
+#include "blas-threads.h"
+
+#if !defined (_WIN32) && !defined (_WIN64)
+  // To detect when the R session has been forked, see 'GetThreadPool'
   #include <unistd.h>
 #endif
 
-#include "thread-utils.h"
+/* Set up the shared progress of a permutation procedure
+ * 
+ * @param nPerm the total number of permutations to compute.
+ * @param nCompleted number of permutations already completed, e.g. when an
+ *   interrupted permutation procedure is resumed.
+ */
+Progress::Progress (unsigned int nPerm, unsigned int nCompleted) : 
+  total(nPerm), initial(nCompleted), completed(nCompleted), interrupted(false),
+  expired(false), begin(std::chrono::steady_clock::now()), timeLimit(0), 
+  minCompleted(0)
+{}
+
+/* Count completed permutations
+ * 
+ * Called by the worker threads. The thread completing the last permutation
+ * wakes up the thread waiting in 'WaitFor'. The mutex is held while 
+ * notifying so that the wake up cannot be missed between the waiting 
+ * thread's check and its wait.
+ * 
+ * @param count number of permutations completed.
+ */
+void Progress::Increment (unsigned int count) {
+  if (completed.fetch_add(count, std::memory_order_acq_rel) + count == total) {
+    std::lock_guard<std::mutex> lock (mutex);
+    finished.notify_all();
+  }
+}
+
+/* Number of permutations completed so far
+ */
+unsigned int Progress::Completed () const {
+  return completed.load(std::memory_order_acquire);
+}
+
+/* Ask the worker threads to stop
+ * 
+ * Also wakes up the thread waiting in 'WaitFor', e.g. when a worker thread 
+ * has to abandon the permutation procedure.
+ */
+void Progress::Interrupt () {
+  interrupted.store(true, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock (mutex);
+  finished.notify_all();
+}
+
+/* Has the permutation procedure been cancelled?
+ */
+bool Progress::Interrupted () const {
+  return interrupted.load(std::memory_order_relaxed);
+}
+
+/* Wait until all permutations are complete or the procedure is interrupted
+ * 
+ * @param secs maximum number of seconds to wait.
+ * 
+ * @return 'true' if all permutations are complete or the procedure has been
+ *   interrupted, or 'false' if 'secs' elapsed first.
+ */
+bool Progress::WaitFor (double secs) {
+  std::unique_lock<std::mutex> lock (mutex);
+  return finished.wait_for(lock, std::chrono::duration<double>(secs), 
+    [this]() { return Completed() >= total || Interrupted(); });
+}
+
+/* Limit the time the permutation procedure may run for
+ * 
+ * Must be called before the worker threads are started.
+ * 
+ * @param secs number of seconds, counted from the creation of the 
+ *   'Progress', after which 'MonitorProgress' stops the permutation 
+ *   procedure, or 0 for no time limit.
+ * @param minPerm number of permutations that must be completed before the
+ *   procedure can be stopped, regardless of the time taken.
+ */
+void Progress::SetTimeLimit (double secs, unsigned int minPerm) {
+  timeLimit = secs;
+  minCompleted = std::min(minPerm, total);
+}
+
+/* Has the time limit been used up?
+ * 
+ * Never 'true' before the minimum number of permutations are complete.
+ */
+bool Progress::OutOfTime () const {
+  if (timeLimit <= 0 || Completed() < minCompleted) {
+    return false;
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+  return elapsed.count() >= timeLimit;
+}
+
+/* Stop the worker threads because the time limit has been used up
+ * 
+ * Unlike a user interrupt, the permutations completed so far are a valid
+ * result, see 'Expired'.
+ */
+void Progress::Expire () {
+  expired.store(true, std::memory_order_relaxed);
+  Interrupt();
+}
+
+/* Was the permutation procedure stopped by its time limit?
+ */
+bool Progress::Expired () const {
+  return expired.load(std::memory_order_relaxed);
+}
+
+/* Start a pool of worker threads
+ * 
+ * @param nThreads number of threads to create.
+ */
+ThreadPool::ThreadPool (unsigned int nThreads) : 
+  generation(0), nBusy(0), stop(false), blasThreads(1)
+{
+  for (unsigned int ii = 0; ii < nThreads; ++ii) {
+    threads.push_back(std::thread(&ThreadPool::Work, this, ii));
+  }
+}
+
+/* Stop the worker threads once they have finished their current job
+ */
+ThreadPool::~ThreadPool () {
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    stop = true;
+  }
+  started.notify_all();
+  for (unsigned int ii = 0; ii < threads.size(); ++ii) {
+    threads[ii].join();
+  }
+}
+
+/* Number of threads in the pool
+ */
+unsigned int ThreadPool::Size () const {
+  return threads.size();
+}
+
+/* Run a job on every thread in the pool
+ * 
+ * Returns immediately, so that the calling thread can monitor the job's 
+ * progress. 'Wait' must be called before the next job is started, and 
+ * before anything 'job' refers to goes out of scope. BLAS libraries 
+ * without per-thread controls are limited to one thread until then, so that
+ * each thread in the pool does not start its own team of BLAS threads.
+ * 
+ * @param job function to run, called with the number of each thread.
+ */
+void ThreadPool::Start (const std::function<void(unsigned int)>& job) {
+  blasThreads = GetBlasThreads();
+  SetBlasThreads(1);
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    this->job = job;
+    error = std::exception_ptr();
+    nBusy = threads.size();
+    ++generation;
+  }
+  started.notify_all();
+}
+
+/* Wait for every thread to finish the current job
+ * 
+ * Any exception thrown by the job, e.g. 'std::bad_alloc', is rethrown here
+ * on the calling thread. The number of BLAS threads is restored.
+ */
+void ThreadPool::Wait () {
+  std::unique_lock<std::mutex> lock (mutex);
+  finished.wait(lock, [this]() { return nBusy == 0; });
+  job = std::function<void(unsigned int)>();
+  SetBlasThreads(blasThreads);
+  if (error) {
+    std::exception_ptr rethrow = error;
+    error = std::exception_ptr();
+    std::rethrow_exception(rethrow);
+  }
+}
+
+/* Main loop of each worker thread: sleep until a job is started, then run it
+ * 
+ * @param thread the number of the thread.
+ */
+void ThreadPool::Work (unsigned int thread) {
+  unsigned long seen = 0; // the last job this thread ran
+  PinBlasToThread();
+  while (true) {
+    std::function<void(unsigned int)> current;
+    {
+      std::unique_lock<std::mutex> lock (mutex);
+      started.wait(lock, [this, seen]() { return stop || generation != seen; });
+      if (stop) {
+        return;
+      }
+      seen = generation;
+      current = job;
+    }
+    try {
+      current(thread);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock (mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      if (--nBusy == 0) {
+        finished.notify_all();
+      }
+    }
+  }
+}
+
+// The pool shared by all permutation procedures in this R session
+static std::unique_ptr<ThreadPool> pool;
+#if !defined (_WIN32) && !defined (_WIN64)
+  static pid_t poolPid; // process the pool's threads belong to
+#endif
 
-// Sleep this thread for N seconds
-void sleep(int secs) {
-  #if defined (_WIN32) || defined (_WIN64)
-    std::this_thread::sleep_for(std::chrono::seconds(secs));
-  #else
-    usleep(secs * 1000000);  
+/* Get the thread pool, creating it if necessary
+ * 
+ * The pool persists across calls so that threads are only created when the
+ * number of threads requested changes. A forked R session (e.g. through 
+ * 'parallel::mclapply') inherits the pool but not its threads, so a new pool
+ * is created there, abandoning the old one without joining its threads.
+ * 
+ * @param nThreads number of threads needed.
+ * 
+ * @return a pool of 'nThreads' threads.
+ */
+ThreadPool& GetThreadPool (unsigned int nThreads) {
+  #if !defined (_WIN32) && !defined (_WIN64)
+    if (pool && poolPid != getpid()) {
+      pool.release();
+    }
+    poolPid = getpid();
   #endif
+  if (!pool || pool->Size() != nThreads) {
+    pool.reset(); // stop the old threads before starting new ones
+    pool.reset(new ThreadPool(nThreads));
+  }
+  return *pool;
+}
+
+/* Stop the pool's threads, e.g. before the package is unloaded
+ */
+void ShutdownThreadPool () {
+  pool.reset();
+}
+
+// Called by R when the package's shared library is unloaded, so that no
+// threads are left running code that is no longer loaded.
+extern "C" void R_unload_NetRep (DllInfo *) {
+  ShutdownThreadPool();
+}
+
+// Format a number of seconds as e.g. "1h 05m", "3m 20s", or "12s"
+static std::string FormatDuration (double secs) {
+  unsigned long ss = (unsigned long)std::ceil(secs);
+  char formatted[32];
+  if (ss >= 3600) {
+    snprintf(formatted, sizeof(formatted), "%luh %02lum", ss / 3600, ss % 3600 / 60);
+  } else if (ss >= 60) {
+    snprintf(formatted, sizeof(formatted), "%lum %02lus", ss / 60, ss % 60);
+  } else {
+    snprintf(formatted, sizeof(formatted), "%lus", ss);
+  }
+  return std::string(formatted);
+}
+
+// Seconds between checks for user interrupts, see 'INTERRUPT_INTERVAL'
+static double InterruptInterval () {
+  SEXP opt = Rf_GetOption1(Rf_install("NetRep.interruptInterval"));
+  if (Rf_isNumeric(opt) && Rf_length(opt) == 1) {
+    double interval = Rf_asReal(opt);
+    if (arma::is_finite(interval) && interval > 0) {
+      return interval;
+    }
+  }
+  return INTERRUPT_INTERVAL;
 }
 
 /* Monitors the progress of the permutation procedure
  * 
  * The primary role of this function is to facilitate user interrupts to cancel
- * the permutation procedure. This runs every second until the permutaton 
- * procedure is complete. If 'verboseFlag' is 'true' then the current progress 
- * is also printed every second.
- * 
- * @param nPerm the total number of permutations to compute
- * @param progressAddr memory address of a vector that is being updated by each 
- *   thread with the number of permutations that have been completed by each 
- *   thread.
- * @param nThreads total number of threads being run.
- * @param interrupted a boolean value in the heap, accessible to each thread,
- *   that is modified when the user attempts to cancel the permutation 
- *   procedure in the R session.
+ * the permutation procedure. It waits for the worker threads to signal that
+ * the last permutation is complete, waking up every 'INTERRUPT_INTERVAL' 
+ * seconds (or the value of the option "NetRep.interruptInterval") to check
+ * for interrupts from the R session, and whether the time limit set by 
+ * 'Progress::SetTimeLimit' has been used up. If 'verboseFlag' is 'true' 
+ * then the current progress, rate of permutations, and estimated time 
+ * remaining are also printed each time.
+ * 
+ * @param progress progress shared with the worker threads.
  * @param verboseFlag if 'false' messages are not printed.
+ * @param checkpoint optional function to call every 'CHECKPOINT_INTERVAL' 
+ *   seconds while the permutation procedure is running. Must not access the
+ *   R API.
  */
 void MonitorProgress (
-    unsigned int& nPerm, unsigned int * progressAddr, unsigned int nThreads,
-    bool& interrupted, const bool& verboseFlag
+    Progress& progress, const bool& verboseFlag, 
+    const std::function<void()>& checkpoint
 ) {
-  arma::uvec progress = arma::uvec(progressAddr, nThreads, false, true);
+  typedef std::chrono::steady_clock clock;
+  const double interval = InterruptInterval();
+  const clock::time_point begin = clock::now();
+  clock::time_point lastCheckpoint = begin;
   
   if (verboseFlag) {
     Rcpp::Rcout << std::endl;
@@ -57,26 +332,141 @@ void MonitorProgress (
   unsigned int nCompleted = 0;
   unsigned int percentCompleted = 0;
   char formatted[6]; // stores a whitespace padded percentage value
+  double elapsed, rate;
   
-  // Every second, check the number of permutations completed, print out the 
-  // % completed, and check for interrupts from the R session.
   while (true) {
-    nCompleted = sum(progress);
+    bool done = progress.WaitFor(interval);
+    nCompleted = progress.Completed();
     if (verboseFlag) {
-      percentCompleted = (unsigned int)round( (float)nCompleted / (float)nPerm * 100);
+      percentCompleted = progress.total == 0 ? 100 :
+        (unsigned int)round( (float)nCompleted / (float)progress.total * 100);
       sprintf(formatted, "%5d", percentCompleted);
       Rcpp::Rcout << "\r" << formatted << "% completed."; 
+      // Only count permutations computed in this run towards the rate
+      elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+      rate = (nCompleted - progress.initial) / elapsed;
+      if (rate > 0) {
+        Rcpp::Rcout << " " << (unsigned long)round(rate) << " permutations/sec";
+        if (!done) {
+          Rcpp::Rcout << ", about " 
+                      << FormatDuration((progress.total - nCompleted) / rate)
+                      << " remaining";
+        }
+        Rcpp::Rcout << ".";
+      }
+      // Clear any leftover characters from a longer previous line
+      Rcpp::Rcout << "        " << std::flush;
     }
-    if (nCompleted == nPerm) {
+    if (done) {
       break;
     } 
     if (checkInterrupt()) {
-      interrupted = true;
+      progress.Interrupt();
+      break;
+    }
+    if (progress.OutOfTime()) {
+      progress.Expire();
       break;
     }
-    sleep(1);
+    if (checkpoint && clock::now() - lastCheckpoint >= 
+          std::chrono::seconds(CHECKPOINT_INTERVAL)) {
+      checkpoint();
+      lastCheckpoint = clock::now();
+    }
   }
   if (verboseFlag) {
     Rcpp::Rcout << std::endl << std::endl;
   }
 }
+
+/* Run a loop in parallel on the thread pool
+ * 
+ * Threads claim one iteration at a time, since iterations (e.g. modules) can
+ * vary widely in cost. The calling thread checks for user interrupts while it
+ * waits, and stops the loop if one is received.
+ * 
+ * @param nThreads number of threads to use.
+ * @param n number of iterations.
+ * @param body function to call with each iteration's index. Must not access
+ *   the R API, and must only write to memory that belongs to its iteration.
+ */
+void ParallelFor (
+    unsigned int nThreads, unsigned int n, 
+    const std::function<void(unsigned int)>& body
+) {
+  if (n == 0) {
+    return;
+  }
+  std::atomic<unsigned int> cursor (0);
+  Progress progress (n);
+  ThreadPool& pool = GetThreadPool(nThreads);
+  pool.Start([&](unsigned int) {
+    unsigned int start, end;
+    try {
+      while (!progress.Interrupted() && ClaimBatch(cursor, 1, n, start, end)) {
+        body(start);
+        progress.Increment();
+      }
+    } catch (...) {
+      progress.Interrupt();
+      throw;
+    }
+  });
+  MonitorProgress(progress, false);
+  pool.Wait();
+  if (progress.Interrupted()) {
+    throw Rcpp::internal::InterruptedException();
+  }
+}
+
+/* Determine how many permutations each thread should claim at a time
+ * 
+ * Small batches keep all threads busy until the last permutation is complete,
+ * while large batches reduce contention on the shared cursor. We aim for each
+ * thread to claim around 16 batches over the course of the permutation 
+ * procedure so that the idle time at the end is a small fraction of the total.
+ * 
+ * @param nPerm the total number of permutations to compute.
+ * @param nThreads total number of threads being run.
+ * 
+ * @return the number of permutations to claim in each batch.
+ */
+unsigned int BatchSize (unsigned int nPerm, unsigned int nThreads) {
+  unsigned int batchSize = nPerm / (nThreads * 16);
+  if (batchSize < 1) {
+    batchSize = 1;
+  }
+  return batchSize;
+}
+
+/* Claim the next batch of permutations from the shared work queue
+ * 
+ * Rather than dividing the permutations evenly between threads up front, each 
+ * thread repeatedly claims a small batch of permutations from a shared atomic
+ * cursor until none are left. This way threads that are descheduled, or that 
+ * draw expensive permutations, do not hold up the remaining threads.
+ * 
+ * @param cursor shared counter holding the index of the next unclaimed 
+ *   permutation.
+ * @param batchSize number of permutations to claim at a time, see 'BatchSize'.
+ * @param nPerm the total number of permutations to compute.
+ * @param start set to the index of the first permutation in the claimed batch.
+ * @param end set to one past the index of the last permutation in the claimed
+ *   batch.
+ * 
+ * @return 'false' if there are no permutations left to claim.
+ */
+bool ClaimBatch (
+    std::atomic<unsigned int>& cursor, unsigned int batchSize, 
+    unsigned int nPerm, unsigned int& start, unsigned int& end
+) {
+  start = cursor.fetch_add(batchSize);
+  if (start >= nPerm) {
+    return false;
+  }
+  end = start + batchSize;
+  if (end > nPerm) {
+    end = nPerm;
+  }
+  return true;
+}
@@ -3,7 +3,93 @@
 
 #include "interrupt.h"
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
-void MonitorProgress (unsigned int&, unsigned int *, unsigned int, bool&, const bool&); 
+// Seconds between calls to the checkpoint function in 'MonitorProgress'
+#define CHECKPOINT_INTERVAL 60
+// Default seconds between checks for user interrupts in 'MonitorProgress',
+// overridden by the option "NetRep.interruptInterval"
+#define INTERRUPT_INTERVAL 0.1
+
+/* Progress of the permutation procedure shared between threads
+ * 
+ * The worker threads count each completed permutation, and the thread that
+ * completes the last one wakes up 'MonitorProgress', so that the permutation
+ * procedure returns as soon as it is done. The monitor sets 'Interrupt' when
+ * the user cancels the permutation procedure, which the workers check 
+ * between modules. The monitor also stops the workers through 'Expire' once
+ * the time limit, if any, has been used up (see 'SetTimeLimit').
+ */
+class Progress {
+public:
+  Progress (unsigned int, unsigned int = 0);
+  void Increment (unsigned int = 1);
+  unsigned int Completed () const;
+  void Interrupt ();
+  bool Interrupted () const;
+  bool WaitFor (double);
+  void SetTimeLimit (double, unsigned int);
+  bool OutOfTime () const;
+  void Expire ();
+  bool Expired () const;
+  const unsigned int total;
+  const unsigned int initial;
+private:
+  std::atomic<unsigned int> completed;
+  std::atomic<bool> interrupted;
+  std::atomic<bool> expired;
+  std::chrono::steady_clock::time_point begin;
+  double timeLimit; // seconds, or 0 if there is no time limit
+  unsigned int minCompleted; // permutations to complete regardless of time
+  std::mutex mutex;
+  std::condition_variable finished;
+};
+
+/* Persistent pool of worker threads
+ * 
+ * Creating threads for every comparison adds up when many datasets and 
+ * modules are analysed, so the threads are created once (see 
+ * 'GetThreadPool') and sleep between jobs. A job is run by every thread in
+ * the pool at once, each receiving its thread number, so jobs divide work 
+ * between themselves, e.g. through 'ClaimBatch'. Only one job may run at a
+ * time, and jobs must not access the R API. BLAS is limited to one thread 
+ * while a job runs, see 'PinBlasToThread'.
+ */
+class ThreadPool {
+public:
+  ThreadPool (unsigned int);
+  ~ThreadPool ();
+  unsigned int Size () const;
+  void Start (const std::function<void(unsigned int)>&);
+  void Wait ();
+private:
+  void Work (unsigned int);
+  std::vector<std::thread> threads;
+  std::function<void(unsigned int)> job;
+  unsigned long generation; // incremented each time a job is started
+  unsigned int nBusy; // threads yet to finish the current job
+  bool stop;
+  std::exception_ptr error; // first exception thrown by the current job
+  int blasThreads; // BLAS threads to restore once the current job finishes
+  std::mutex mutex;
+  std::condition_variable started;
+  std::condition_variable finished;
+};
+
+ThreadPool& GetThreadPool (unsigned int);
+void ShutdownThreadPool ();
+
+void MonitorProgress (Progress&, const bool&, 
+                      const std::function<void()>& = std::function<void()>()); 
+void ParallelFor (unsigned int, unsigned int, const std::function<void(unsigned int)>&);
+unsigned int BatchSize (unsigned int, unsigned int);
+bool ClaimBatch (std::atomic<unsigned int>&, unsigned int, unsigned int, unsigned int&, unsigned int&);
 
 #endif // __PROGRESS__
@@ -1,4 +1,6 @@
 #include "utils.h"
+#include <algorithm>
+#include <functional>
 
 /* Build a dictionary mapping labels to a sequence of integers
  */
@@ -161,43 +163,198 @@ arma::uvec GetNodeIdx (
   return modIdx;
 }
 
-/* Get a random selection of nodes of size N from a dataset
+/* Compile the modules into an integer-indexed layout for the permutation 
+ * procedure
  * 
- * @param module module we want to get random indices for.
- * @param modNodeMap mapping between module labels and node IDs.
- * @param nodeIdxAddr memory address of a shuffled vector of node indices in 
- *  the test dataset. These indices correspond to the set of nodes to use when 
- *  generating the null distributions.
- * @param nNullNodes number of nodes in the null distribution vector.
- * @param nullMap a mapping of node IDs to indices of the 'nodeIdx' vector.
+ * @param mods vector of modules for which the module preservation statistics
+ *   are being calculated for.
+ * @param modNodeMap mapping of module labels to node IDs.
+ * @param modIdxMap mapping of module labels to rows in the results.
+ * @param nullMap a mapping of node IDs to indices of the 'nullIdx' vector, 
+ *   see 'MakeNullMap'.
+ * @param addrWD mapping of module labels to the memory addresses of their 
+ *   weighted degree vectors in the discovery dataset.
+ * @param addrCV mapping of module labels to the memory addresses of their 
+ *   correlation coefficient vectors in the discovery dataset.
+ * @param addrNC mapping of module labels to the memory addresses of their 
+ *   node contribution vectors in the discovery dataset. May be empty if the
+ *   data matrices have not been provided.
+ *   
+ * @return a 'ModulePlan'.
+ */
+ModulePlan MakeModulePlan (
+  const std::vector<std::string>& mods, const stringmap& modNodeMap, 
+  const namemap& modIdxMap, const namemap& nullMap, addrmap& addrWD,
+  addrmap& addrCV, addrmap& addrNC
+) {
+  ModulePlan plan;
+  plan.maxNodes = 0;
+  plan.offsets.push_back(0);
+  
+  // Number each distinct node across all modules with a slot in the random
+  // sample drawn at each permutation.
+  intmap slotMap;
+  unsigned int pos;
+  
+  for (auto mi = mods.begin(); mi != mods.end(); ++mi) {
+    plan.rows.push_back(modIdxMap.at(*mi));
+    
+    auto keyit = modNodeMap.equal_range(*mi);
+    for (auto it = keyit.first; it != keyit.second; ++it) {
+      pos = nullMap.at(it->second);
+      auto slot = slotMap.find(pos);
+      if (slot == slotMap.end()) {
+        slot = slotMap.emplace(pos, slotMap.size()).first;
+      }
+      plan.nodes.push_back(slot->second);
+    }
+    plan.offsets.push_back(plan.nodes.size());
+    
+    unsigned int mNodes = plan.offsets.back() - plan.offsets[plan.offsets.size() - 2];
+    if (mNodes > plan.maxNodes) {
+      plan.maxNodes = mNodes;
+    }
+    
+    plan.degree.push_back(addrWD.at(*mi));
+    plan.corr.push_back(addrCV.at(*mi));
+    auto nc = addrNC.find(*mi);
+    plan.contribution.push_back(nc != addrNC.end() ? nc->second : NULL);
+    
+    // The discovery properties are the same at every permutation, so 
+    // summarise them once here.
+    plan.degreeMoments.push_back(DiscoveryMoments(plan.degree.back(), mNodes));
+    plan.corrMoments.push_back(
+      DiscoveryMoments(plan.corr.back(), ((std::size_t)mNodes * mNodes - mNodes) / 2)
+    );
+    if (plan.contribution.back() != NULL) {
+      plan.contributionMoments.push_back(
+        DiscoveryMoments(plan.contribution.back(), mNodes)
+      );
+    } else {
+      plan.contributionMoments.push_back(Moments());
+    }
+  }
+  plan.nSlots = slotMap.size();
+  
+  return plan;
+}
+
+/* Get a random selection of nodes for a module from a dataset
+ * 
+ * @param plan the compiled module layout, see 'MakeModulePlan'.
+ * @param module index of the module in 'plan'.
+ * @param nodeIdxAddr memory address of a random sample of node indices in 
+ *  the test dataset, drawn from the set of nodes to use when generating the 
+ *  null distributions. Must contain at least 'plan.nSlots' elements.
+ * @param randIdxAddr memory address of a vector of at least 'plan.maxNodes'
+ *  elements to fill with the indices in the test dataset.
  * 
- * @return a vector of indices in the test dataset.
+ * @return the number of nodes in the module.
  */ 
-arma::uvec GetRandomIdx(
-  std::string& module, const stringmap& modNodeMap, unsigned int * nodeIdxAddr,
-  unsigned int nNullNodes, namemap& nullMap
+unsigned int GetRandomIdx(
+  const ModulePlan& plan, unsigned int module, unsigned int * nodeIdxAddr,
+  unsigned int * randIdxAddr
 ) {
-  // Construct armadillo matrices and vectors from memory addresses and 
-  // provided sizes
-  arma::uvec nodeIdx = arma::uvec(nodeIdxAddr, nNullNodes, false, true);
-  
-  unsigned int nNodes = modNodeMap.count(module);
-  arma::uvec randIdx (nNodes);
+  unsigned int start = plan.offsets[module];
+  unsigned int nNodes = plan.offsets[module + 1] - start;
   
-  // For each node in the module, get the nodes static position in the 'nodeIdx'
-  // vector, pull out the randomly assigned indice in the test network 
-  // stored in that location in 'nodeIdx', and put it in the vector of random
-  // node ids. Random assignment of indices happens once per permutation, 
-  // through the use of 'shuffle' on the 'nodeIdx' vector.
-  unsigned int counter = 0;
-  auto keyit = modNodeMap.equal_range(module);
-  for (auto it = keyit.first; it != keyit.second; ++it) {
-    std::string nodeId = it->second;
-    randIdx.at(counter) = nodeIdx.at(nullMap.at(nodeId));
-    counter++;
+  // For each node in the module, look up the node's static slot in the 
+  // random sample, and pull out the randomly assigned indice in the test 
+  // network stored in that location. Random assignment of indices happens 
+  // once per permutation, through drawing the sample from 'nullIdx'.
+  for (unsigned int ii = 0; ii < nNodes; ++ii) {
+    randIdxAddr[ii] = nodeIdxAddr[plan.nodes[start + ii]];
   }
   
-  return randIdx;
+  return nNodes;
+}
+
+/* Tally one permutation's statistics against the observed statistics
+ * 
+ * Used instead of storing the null distributions when only the permutation 
+ * test p-values are needed. 'talliesAddr' points to a column-major array 
+ * with dimensions 'nModules' x 'nStats' x 3, holding the number of 
+ * permutations with a statistic less than or equal to the observed value, 
+ * greater than or equal to the observed value, and the number of 
+ * permutations where the statistic could be calculated at all. Non-finite
+ * statistics are not counted, matching 'permutationTest' in R.
+ * 
+ * @param statsAddr memory address of a 'nModules' x 'nStats' matrix of 
+ *   statistics calculated in a single permutation.
+ * @param obsAddr memory address of the 'nModules' x 'nStats' matrix of 
+ *   observed statistics.
+ * @param nModules number of modules.
+ * @param nStats number of statistics.
+ * @param talliesAddr memory address of the tallies to update.
+ */
+void TallyNulls (
+  double * statsAddr, double * obsAddr, unsigned int nModules, 
+  unsigned int nStats, unsigned int * talliesAddr
+) {
+  unsigned int nCells = nModules * nStats;
+  for (unsigned int ii = 0; ii < nCells; ++ii) {
+    if (arma::is_finite(statsAddr[ii])) {
+      if (statsAddr[ii] <= obsAddr[ii]) {
+        talliesAddr[ii]++;
+      }
+      if (statsAddr[ii] >= obsAddr[ii]) {
+        talliesAddr[nCells + ii]++;
+      }
+      talliesAddr[2*nCells + ii]++;
+    }
+  }
+}
+
+/* Keep the most extreme values of one permutation's statistics
+ * 
+ * Used alongside 'TallyNulls' when the null distributions are not stored, 
+ * so that their tails can still be extrapolated from (see 'gpdTest' in R).
+ * 'tailsAddr' points to 'TAIL_SIZE' values for each statistic holding the 
+ * largest values so far as a min-heap, followed by 'TAIL_SIZE' values for 
+ * each statistic holding the smallest values so far as a max-heap. 
+ * Non-finite statistics are not kept.
+ * 
+ * Must be called before 'TallyNulls' for the same permutation.
+ * 
+ * @param statsAddr memory address of a 'nModules' x 'nStats' matrix of 
+ *   statistics calculated in a single permutation.
+ * @param nCells number of elements in the matrix of statistics.
+ * @param countsAddr memory address of the number of finite values tallied so
+ *   far for each statistic, i.e. the "n.perm" slice of the tallies.
+ * @param tailsAddr memory address of the tails to update.
+ */
+void TallyTails (
+  double * statsAddr, unsigned int nCells, unsigned int * countsAddr,
+  double * tailsAddr
+) {
+  double * upper;
+  double * lower;
+  unsigned int nKept;
+  for (unsigned int ii = 0; ii < nCells; ++ii) {
+    if (!arma::is_finite(statsAddr[ii])) {
+      continue;
+    }
+    upper = tailsAddr + (std::size_t)ii * TAIL_SIZE;
+    lower = tailsAddr + (std::size_t)(nCells + ii) * TAIL_SIZE;
+    nKept = std::min(countsAddr[ii], (unsigned int)TAIL_SIZE);
+    if (nKept < TAIL_SIZE) {
+      upper[nKept] = statsAddr[ii];
+      std::push_heap(upper, upper + nKept + 1, std::greater<double>());
+      lower[nKept] = statsAddr[ii];
+      std::push_heap(lower, lower + nKept + 1, std::less<double>());
+      continue;
+    }
+    if (statsAddr[ii] > upper[0]) {
+      std::pop_heap(upper, upper + TAIL_SIZE, std::greater<double>());
+      upper[TAIL_SIZE - 1] = statsAddr[ii];
+      std::push_heap(upper, upper + TAIL_SIZE, std::greater<double>());
+    }
+    if (statsAddr[ii] < lower[0]) {
+      std::pop_heap(lower, lower + TAIL_SIZE, std::less<double>());
+      lower[TAIL_SIZE - 1] = statsAddr[ii];
+      std::push_heap(lower, lower + TAIL_SIZE, std::less<double>());
+    }
+  }
 }
 
 /* Get the indices of a module's nodes in the respective dataset
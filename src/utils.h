@@ -5,13 +5,15 @@
 #define ARMA_USE_BLAS
 #define ARMA_NO_DEBUG
 #define ARMA_DONT_PRINT_ERRORS
-o//#define ARMA_DONT_USE_CXX11
+//#define ARMA_DONT_USE_CXX11
 #define BOOST_DISABLE_ASSERTS
 
 #include <RcppArmadillo.h>
 #include <boost/unordered_map.hpp>
 #include <string>
 
+#include "netStats.h"
+
 // For mapping column/row/names to indices of respective data structures
 typedef boost::unordered_map<std::string, unsigned int> namemap; 
 // For mapping module labels to node IDs 
@@ -21,6 +23,35 @@ typedef boost::unordered_map<std::string, double *> addrmap;
 // For getting randomly shuffled node ids
 typedef boost::unordered_map<unsigned int, unsigned int> intmap;
 
+// Number of the most extreme null distribution values kept in each tail, 
+// see 'TallyTails'.
+#define TAIL_SIZE 250
+
+/* Integer-indexed layout of the modules analysed in the permutation procedure
+ * 
+ * Built once, before any threads are started, so that the permutation 
+ * procedure does not need to hash any strings. The nodes of module 'ii' are 
+ * stored in 'nodes[offsets[ii]]' to 'nodes[offsets[ii+1] - 1]', as slots in
+ * the random sample drawn from the vector of indices to shuffle ('nullIdx') 
+ * at each permutation. Slots are numbered compactly across the union of all 
+ * modules, so only 'nSlots' elements of 'nullIdx' need to be drawn. Node 
+ * order matches the order of the properties calculated in the discovery 
+ * dataset.
+ */
+struct ModulePlan {
+  std::vector<unsigned int> rows; // rows in the results for each module
+  std::vector<unsigned int> offsets; // start of each module in 'nodes'
+  std::vector<unsigned int> nodes; // slot of each node in the random sample
+  std::vector<double *> degree; // addresses of the discovery weighted degree
+  std::vector<double *> corr; // addresses of the discovery correlation vectors
+  std::vector<double *> contribution; // addresses of the discovery node contributions
+  std::vector<Moments> degreeMoments; // see 'DiscoveryMoments'
+  std::vector<Moments> corrMoments;
+  std::vector<Moments> contributionMoments;
+  unsigned int maxNodes; // number of nodes in the largest module
+  unsigned int nSlots; // number of nodes to draw at each permutation
+};
+
 // Utility functions
 void ShowProgress(unsigned int&, unsigned int&);
 namemap MakeIdxMap (const std::vector<std::string>&);
@@ -28,7 +59,10 @@ stringmap MakeModMap (Rcpp::CharacterVector);
 stringmap MakeModMap (Rcpp::CharacterVector, const namemap&);
 namemap MakeNullMap (const std::vector<std::string>&, const namemap&, arma::uvec&);
 arma::uvec GetNodeIdx (std::string&, const stringmap&, const namemap&);
-arma::uvec GetRandomIdx(std::string&, const stringmap&, unsigned int *, unsigned int, namemap&);
+ModulePlan MakeModulePlan (const std::vector<std::string>&, const stringmap&, const namemap&, const namemap&, addrmap&, addrmap&, addrmap&);
+unsigned int GetRandomIdx(const ModulePlan&, unsigned int, unsigned int *, unsigned int *);
+void TallyNulls (double *, double *, unsigned int, unsigned int, unsigned int *);
+void TallyTails (double *, unsigned int, unsigned int *, double *);
 std::vector<std::string> GetModNodeNames (std::string&, const stringmap&);
 void Fill(Rcpp::NumericVector&, double *, unsigned int, unsigned int *, unsigned int);
 